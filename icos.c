@@ -14,18 +14,57 @@
 
 // Based on CSCI 5229 (University of Colorado at Boulder) class project
 
+#define BLOCK 512              // control volumes per operator sweep block
 #define EARTHS 3
+#define FIELDCHUNK 4096        // field values staged per read
+#define FIT 18                 // most neighbours in an operator stencil
 #define FONT GLUT_BITMAP_8_BY_13
+#define FRAMES 256
 #define GL_GLEXT_PROTOTYPES
-#define GRIDS 5
+#define GLYPHH 16
+#define GLYPHW 8
+#define GRIDS 11
+#define LOCALMAX 12            // finest level local refinement may reach
 #define PI 3.14159265
+#define REGIONS 16
+#define SLOTS 3                // field timestep slots: triple buffering
+#define STAGES 8
+#define TESSMAX 10             // finest level the shader render mode draws
+#define TESSPATCH 4            // levels done by the geometry shader per patch
+#define TICK .03               // seconds between idle() state updates
+#define VALENCE 12             // most triangles around an exported vertex
+#define WBUF (4<<20)           // export writer chunk size (bytes)
+
+// instrumented stages (indices into stage arrays)
+
+#define ST_GRID 0
+#define ST_SPHERE 1
+#define ST_CENTROIDS 2
+#define ST_NORMALS 3
+#define ST_TEXT 4
+#define ST_BISECT 5            // refinement stages from here on
+#define ST_EXTEND 6
+#define ST_NSCS 7
 
 #include <GL/glut.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <float.h>
 #include <math.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <time.h>
+#include <unistd.h>
 
 struct T // triangles
 {
@@ -34,11 +73,100 @@ struct T // triangles
   double c[3];                 // centroid
 };
 
+struct F // streamed per-cell scalar field
+{
+  char *name;                  // file or pipe the timesteps come from
+  float *map;                  // persistently mapped slots
+  float range[SLOTS][2];       // value range of each slot's timestep
+  float lo,hi;                 // color map range, over timesteps shown
+  int fd;                      // stream descriptor
+  int level;                   // grid level the field lives on
+  int n;                       // cells (triangles) per timestep
+  int stride;                  // floats per slot, aligned for texture buffers
+  int back,mid,front;          // slots being read into, newest whole, drawn
+  int fresh;                   // has mid been filled since it was taken?
+  int pace;                    // hold each timestep until taken? (files)
+  long read,shown;             // timesteps read & taken for drawing
+  pthread_mutex_t lock;        // guards back, mid, fresh, range & read
+  pthread_cond_t taken;        // signalled when mid is taken
+  GLsync fence[SLOTS];         // after the last draw reading each slot
+  unsigned int buf;            // buffer object holding the slots
+  unsigned int tex[SLOTS];     // texture buffer view of each slot
+  unsigned int vbo;            // cell corner positions
+  unsigned int prog;           // color-mapping shader program
+};
+
 struct G // grid
 {
   struct T* Tp;                // pointer to triangles
   int nTs;                     // number of triangles
 };
+
+struct A // local refinement tree node
+{
+  int v[3];                    // vertices, indices into lverts
+  int kids;                    // first of four children (0 => leaf)
+  int level;                   // refinement level (-1 => free)
+};
+
+struct C // region of interest, a spherical cap
+{
+  double c[3];                 // unit vector to centre
+  double r;                    // angular radius (radians)
+  int level;                   // level to refine to within
+};
+
+struct E // input event
+{
+  long tick;                   // idle() updates done before the event
+  char kind;                   // k => key(), s => special(), e => end
+  int code;                    // key code
+};
+
+struct H // local refinement edge table entry
+{
+  int a,b;                     // vertices, a<b (b==0 => empty)
+  int mid;                     // midpoint vertex
+  int count;                   // refined nodes splitting this edge
+};
+
+struct M // indexed polygon mesh, built for export
+{
+  double *v;                   // vertex coordinates, 3 per vertex
+  int *p;                      // polygon vertex indices
+  int *o;                      // offsets of polygons into p (np+1 entries)
+  int nv;                      // number of vertices
+  int np;                      // number of polygons
+};
+
+struct R // trace record
+{
+  double t;                    // frame start time (s since first frame)
+  double ms;                   // frame cost (ms)
+  double st[STAGES];           // stage cpu times this frame (ms)
+  double gpu[ST_BISECT];       // drawing stage gpu times, a frame late (ms)
+  long tris;                   // triangles submitted
+  long verts;                  // vertices submitted
+  int level;                   // grid level
+};
+
+struct S // stencil operator coefficients, for one kind of control volume
+{
+  int n;                       // number of control volumes
+  int w;                       // neighbours per volume (padded)
+  double *x;                   // volume positions, 3 per volume
+  int *nb;                     // k'th neighbour of volume i, at [k*n+i]
+  double *lap;                 // laplacian weights
+  double *g[3];                // gradient & divergence weights
+  double *t[3];                // curl weights
+};
+
+struct W // buffered streaming writer
+{
+  FILE *f;                     // output file
+  char *buf;                   // chunk being filled
+  size_t n;                    // bytes used in chunk
+};
   
 // colors
 
@@ -53,17 +181,181 @@ double yellow[4]={1,1,0,1};
 
 // global variables
 
+char *exportfmts[]=            // supported export formats
+{
+  "ply","obj","vtk"
+};
+char *fieldglsl[2]=            // field color-mapping shader sources
+{
+  // vertex: cell corner, tagged with its barycentric coordinates
+  "#version 400 compatibility\n"
+  "out vec3 pos;\n"
+  "out vec3 bary;\n"
+  "void main()\n"
+  "{\n"
+  "  int k=gl_VertexID%3;\n"
+  "  pos=gl_Vertex.xyz;\n"
+  "  bary=vec3(k==0,k==1,k==2);\n"
+  "  gl_Position=gl_ModelViewProjectionMatrix*gl_Vertex;\n"
+  "}\n",
+  // fragment: cell value through a cool-warm color map, lit & edged like
+  // the shader render mode's faces, except that edges are left out of
+  // cells too small on screen for them not to hide the data
+  "#version 400 compatibility\n"
+  "uniform samplerBuffer values;\n"
+  "uniform float lo,hi;\n"
+  "uniform vec3 light;\n"
+  "uniform vec4 edgecolor;\n"
+  "uniform int edges;\n"
+  "in vec3 pos;\n"
+  "in vec3 bary;\n"
+  "void main()\n"
+  "{\n"
+  "  float t=(texelFetch(values,gl_PrimitiveID).r-lo)/max(hi-lo,1e-30);\n"
+  "  vec3 c,w=fwidth(bary),e=bary/max(w,1e-6);\n"
+  "  vec3 n=normalize(cross(dFdx(pos),dFdy(pos)));\n"
+  "  t=clamp(t,0.0,1.0);\n"
+  "  c=t<0.5?mix(vec3(0.23,0.30,0.75),vec3(0.87),2.0*t):\n"
+  "          mix(vec3(0.87),vec3(0.71,0.02,0.15),2.0*t-1.0);\n"
+  "  if (dot(n,pos)<0.0) n=-n;\n"
+  "  c*=0.6+0.4*max(dot(n,normalize(light-pos)),0.0);\n"
+  "  if (edges!=0&&max(w.x,max(w.y,w.z))<0.2&&min(e.x,min(e.y,e.z))<0.5)\n"
+  "    gl_FragColor=edgecolor;\n"
+  "  else gl_FragColor=vec4(c,1.0);\n"
+  "}\n"
+};
+char *stagenames[STAGES]=      // labels for instrumented stages
+{
+  "drawgrid","shellsphere","drawcentroids","drawnormals","drawtext",
+  "bisect","extend","set_ns_and_cs"
+};
+char *tessglsl[5]=             // shader render mode sources
+{
+  // common header
+  "#version 400 compatibility\n",
+  // midpoint rule shared by the vertex & evaluation stages: as in bisect()
+  // & extend(), except that the last level's midpoints may be only partly
+  // extended, to morph between levels
+  "uniform float radius;\n"
+  "uniform float morph;\n"
+  "vec3 mid(vec3 p,vec3 q,bool last)\n"
+  "{\n"
+  "  vec3 m=(p+q)/2.0;\n"
+  "  return last?mix(m,normalize(m)*radius,morph):normalize(m)*radius;\n"
+  "}\n",
+  // vertex: corner of a base face, refined to the patch picked by the
+  // base-4 digits of the instance id
+  "uniform vec3 base[12];\n"
+  "uniform int faces[60];\n"
+  "uniform int sublevels;\n"
+  "out vec3 cp;\n"
+  "void main()\n"
+  "{\n"
+  "  int f=gl_VertexID/3,k=gl_VertexID%3,q,s;\n"
+  "  vec3 a=base[faces[3*f]],b=base[faces[3*f+1]],c=base[faces[3*f+2]];\n"
+  "  vec3 ab,bc,ca;\n"
+  "  for (s=sublevels-1;s>=0;s--)\n"
+  "  {\n"
+  "    ab=mid(a,b,false); bc=mid(b,c,false); ca=mid(c,a,false);\n"
+  "    q=(gl_InstanceID>>(2*s))&3;\n"
+  "    if (q==0) { b=ab; c=ca; }\n"
+  "    else if (q==1) { a=ab; c=bc; }\n"
+  "    else if (q==2) { a=ca; b=bc; }\n"
+  "    else { a=ab; b=bc; c=ca; }\n"
+  "  }\n"
+  "  cp=k==0?a:(k==1?b:c);\n"
+  "}\n",
+  // geometry: the patch's grid, located by repeated bisection as in
+  // bisect() & extend(); each invocation emits one of the patch's four
+  // sub-triangles (the whole patch at level 0) as strips of lattice points,
+  // at most 8 per side so as to stay within the output limits
+  "layout(triangles,invocations=4) in;\n"
+  "layout(triangle_strip,max_vertices=80) out;\n"
+  "uniform int patchlevels;\n"
+  "in vec3 cp[];\n"
+  "out vec3 pos;\n"
+  "out vec3 lattice;\n"
+  "void point(ivec3 l)\n"
+  "{\n"
+  "  int h,s;\n"
+  "  vec3 a=cp[0],b=cp[1],c=cp[2],ab,bc,ca;\n"
+  "  lattice=vec3(l);\n"
+  "  for (s=patchlevels;s>0;s--)\n"
+  "  {\n"
+  "    h=1<<(s-1);\n"
+  "    ab=mid(a,b,s==1); bc=mid(b,c,s==1); ca=mid(c,a,s==1);\n"
+  "    if (l.x>=h) { b=ab; c=ca; l.x-=h; }\n"
+  "    else if (l.y>=h) { a=ab; c=bc; l.y-=h; }\n"
+  "    else if (l.z>=h) { a=ca; b=bc; l.z-=h; }\n"
+  "    else { a=ab; b=bc; c=ca; l=ivec3(h)-l.zxy; }\n"
+  "  }\n"
+  "  pos=l.x==1?a:(l.y==1?b:c);\n"
+  "  gl_Position=gl_ModelViewProjectionMatrix*vec4(pos,1.0);\n"
+  "  EmitVertex();\n"
+  "}\n"
+  "void main()\n"
+  "{\n"
+  "  int n=1<<patchlevels,m=max(n/2,1),q=gl_InvocationID,i,r;\n"
+  "  ivec3 o=ivec3(m,m,0),u=ivec3(-1,1,0),v=ivec3(-1,0,1);\n"
+  "  if (n==1&&q>0) return;\n"
+  "  if (q==0) o=ivec3(n,0,0);\n"
+  "  else if (q==2) o=ivec3(m,0,m);\n"
+  "  else if (q==3) { u=ivec3(-1,0,1); v=ivec3(0,-1,1); }\n"
+  "  for (r=0;r<m;r++)\n"
+  "  {\n"
+  "    for (i=0;i<m-r;i++)\n"
+  "    {\n"
+  "      point(o+r*u+i*v);\n"
+  "      point(o+(r+1)*u+i*v);\n"
+  "    }\n"
+  "    point(o+r*u+i*v);\n"
+  "    EndPrimitive();\n"
+  "  }\n"
+  "}\n",
+  // fragment: flat-shaded faces, lit like drawgrid()'s per-triangle normals,
+  // with edges drawn where the patch lattice coordinates are whole numbers
+  // (much cheaper than a second, line-mode pass)
+  "uniform vec3 light;\n"
+  "uniform vec4 color;\n"
+  "uniform vec4 edgecolor;\n"
+  "uniform int edges;\n"
+  "in vec3 pos;\n"
+  "in vec3 lattice;\n"
+  "void main()\n"
+  "{\n"
+  "  vec3 e=abs(lattice-round(lattice))/max(fwidth(lattice),1e-6);\n"
+  "  vec3 n=normalize(cross(dFdx(pos),dFdy(pos)));\n"
+  "  float d;\n"
+  "  if (dot(n,pos)<0.0) n=-n;\n"
+  "  d=0.45+0.5*max(dot(n,normalize(light-pos)),0.0);\n"
+  "  if (edges!=0&&min(e.x,min(e.y,e.z))<0.5) gl_FragColor=edgecolor;\n"
+  "  else gl_FragColor=vec4(color.rgb*d,color.a);\n"
+  "}\n"
+};
+char *tracename=NULL;          // file to dump frame trace to on exit
 double ar=1;                   // aspect ratio
 double defearthalpha=.75;      // default transparency of globe overlay
 double *deffc=grey;            // default triangle face color
 double dim=2.5;                // size for ortho box
 double earthalpha;             // current transparency of globe overlay
 double facecolor[4];           // color for geodesic faces
+double firstframe=-1;          // start time of first frame
+double framecost=0;            // cost of last frame (ms)
+double frametimes[FRAMES];     // recent frame intervals (ms), a ring
+double lastframe=0;            // start time of last frame
 double lasttime=0;             // keep track of time for animation
+double (*lverts)[3]=NULL;      // local refinement vertices
 double p;                      // special icosahedron coordinate
 double radius=0;               // distance from origin to vertex
+double stagecur[STAGES];       // stage times accumulated this frame (ms)
+double stagegpu[ST_BISECT];    // drawing stage gpu times, a frame late (ms)
+double stagelast[STAGES];      // stage times last measured (ms)
+double stagestart[STAGES];     // start times of running stages
+double tessl=0;                // level drawn in shader mode (may be fractional)
 double th=0,ph=0,la=0;         // display/light angles
 double vertex[12][3];          // storage for initial icos vertices
+FILE *recordf=NULL;            // input events are recorded here
+FILE *replayf=NULL;            // input events are replayed from here
 int animatem=1;                // animation mode: 0 => instant, 1 => animated
 int animaten=0;                // to remember this grid's number of triangles
 int animatep=0;                // is an animation active?
@@ -71,46 +363,141 @@ int animates=0;                // animation stage: 1 => bisection done
 int axesp=0;                   // whether to show axes
 int centroidsp=0;              // display centroids?
 int edgesp=1;                  // show triangle-face edges?
+int exportfmt=0;               // export format: index into exportfmts
+int face[20][3]=               // the 20 faces of the icosahedron
+{
+  {0,1,5},{1,2,5},{2,3,5},{3,4,5},{4,0,5},
+  {0,1,6},{1,2,7},{2,3,8},{3,4,9},{4,0,10},
+  {7,6,1},{8,7,2},{9,8,3},{10,9,4},{6,10,0},
+  {6,7,11},{7,8,11},{8,9,11},{9,10,11},{10,6,11}
+};
+int fastp=0;                   // replay as fast as possible?
+int fieldp=0;                  // show the streamed field?
 int fixedp=0;                  // do not rotate during refinement?
 int fov=55;                    // field of view for perspective
+int framen=0;                  // number of frames timed
+int *freekids=NULL;            // freed blocks of local refinement nodes
+int hudp=0;                    // show instrumentation overlay?
+int injectp=0;                 // is replay() delivering an event?
 int level=0;                   // current grid level
-int levels=GRIDS;              // max grid level allowed
+int levels=GRIDS-1;            // max grid level allowed
+int localp=0;                  // show local refinement instead of the grid?
+int maxfreekids=0,nfreekids=0; // allocated & used entries in freekids
+int maxlnodes=0,nlnodes=0;     // allocated & used local refinement nodes
+int maxlverts=0,nlverts=0;     // allocated & used local refinement vertices
+int nlocal=0;                  // allocated triangles in local grid
 int normalsp=0;                // draw all normals? (0 => disable)
+int nregions=0;                // number of regions of interest
 int play=1;                    // auto-play
 int projmode=0;                // orthogonal (0) vs perspective (1)
 int refinem=0;                 // refine mode: 0 => 2-step, 1 => 1-step
 int spherep=1;                 // show translucent sphere?
+int stageq=0;                  // which set of stage queries this frame uses
+int stageran[2][ST_BISECT];    // did each set's stage queries run?
+int tessp=0;                   // draw the grid with shaders?
+int tesstarget=0;              // level shader mode is moving towards
 int textp=1;                   // display text?
 int texturen=1;                // which texture? 0 => none
+int tracemax=0;                // allocated trace records
+int tracen=0;                  // used trace records
+long nverts=0,ntris=0;         // vertices & triangles submitted this frame
+long nvertslast=0,ntrislast=0; // vertices & triangles submitted last frame
+long ticks=0;                  // idle() updates done so far
+size_t arenasize=0;            // bytes reserved for all grid levels
+size_t maxledges=0,nledges=0;  // allocated & used local edge table entries
+struct A *lnodes=NULL;         // local refinement trees, roots first
+struct C regions[REGIONS];     // regions of interest for local refinement
+struct E event;                // next event to replay
+struct F field;                // streamed per-cell field (-s)
 struct G grid[GRIDS];          // storage for generated grids
+struct G local;                // flattened, conforming local refinement
+struct H *ledges=NULL;         // local refinement edges, hashed
+struct R *trace=NULL;          // per-frame trace records
+struct T *arena=NULL;          // one reservation holding every grid level
+unsigned int glyphs=0;         // cached font texture (0 => not yet built)
+unsigned int stagequeries[2][ST_BISECT]; // gpu timers for drawing stages
+unsigned int tessprog=0;       // shader mode program (0 => not built)
+unsigned int tessvao=0;        // empty vertex array for attribute-less draws
 unsigned int textures[EARTHS]; // opaque handle for texture
 
 // function prototypes
 
 double distance(double,double,double,double,double,double);
+double now();
+int addnb(int *,int,int,int);
+int attachshader(unsigned int,unsigned int,int,char **);
+int bench(int);
+int closure();
+int cmpd(const void *,const void *);
+int cmpl(const void *,const void *);
+int cmpt(const void *,const void *);
+int fieldget(void *,size_t);
+int gridsize(int);
+int linkprogram(unsigned int);
+int lkids(int);
+int lmid(int,int);
+int lvertex(double *);
+int splitp(int,int);
+int timingp();
+int wantlevel(int);
+long resident(int);
+long tesscell(double *,int,int,int);
+struct G *shown();
+struct H *ledge(int,int,int);
+struct T *levelbuf(int);
+void *fieldreader(void *);
+void adapt();
 void bisect();
+void buildduals(struct T *,struct M *,struct M *);
+void buildglyphs();
+void buildmesh(struct T *,int,struct M *);
+void buildstencils(int,struct S *,struct S *);
 void centroid(double [3][3],struct T *);
+void coarsen(int);
 void die(char *);
 void display();
 void downgrid();
 void drawaxes();
 void drawcentroids();
 void drawchars();
-void drawgrid(int,double [3],double [3]);
+void drawgrid(struct G *,double [3],double [3]);
+void drawhud();
 void drawnormals();
 void drawtext();
+void dumptrace();
+void endframe(double);
+void endrecord();
 void errorcheck();
+void export(int);
+void exportmesh(struct M *,char *);
 void extend_vertex(struct T*);
 void extend_vertices();
+void fielddraw(double [4]);
+void fieldopen();
+void fieldtake();
+void flatten(int);
+void freemesh(struct M *);
+void freestencil(struct S *);
+void hudchars(char *,int,int);
 void icosahedron();
 void idle();
 void init();
 void key(unsigned char,int,int);
 void loadtextures();
 void midpoints(struct T *,double [3][3]);
+void newstencil(struct S *,int,int,double *);
 void normal(struct T *,double [3][3]);
+void opcurl(struct S *,double *,double *,double *,double *);
+void opdivergence(struct S *,double *,double *,double *,double *);
+void opgradient(struct S *,double *,double *,double *,double *);
+void oplaplacian(struct S *,double *,double *);
 void project();
+void prune(int);
+void record(char,int);
 void refine();
+void refinewanted(int);
+void region(char *);
+void replay();
 void reshape(int,int);
 void rotate_la(double);
 void rotate_ph(double);
@@ -120,10 +507,55 @@ void setfc(double *);
 void shellsphere();
 void special(int,int,int);
 void spherev(double,double);
+void splitnode(int);
+void stencilfit(struct S *,int,int *,int);
+void tessbuild();
+void tessdraw(double [4],double [4]);
+void tessverify();
+void tic(int);
+void toc(int);
 void upgrid();
+void wbe32(struct W *,uint32_t);
+void wbe64(struct W *,double);
+void wbytes(struct W *,void *,size_t);
+void wclose(struct W *);
+void wflush(struct W *);
+void wopen(struct W *,char *);
+void wprintf(struct W *,char *,...);
 
 // functions
 
+void adapt()
+{
+  // bring the local refinement tree to the current base level & regions:
+  // coarsen what is no longer wanted, refine what is, then close the mesh
+  // so that it conforms, & flatten its leaves into the local grid
+  int i;
+  if (!lnodes)
+  {
+    // the roots are the 20 faces of the initial icosahedron
+    for (i=0;i<12;i++)
+      lvertex(vertex[i]);
+    nlnodes=maxlnodes=20;
+    lnodes=(struct A *)malloc(maxlnodes*sizeof(struct A));
+    if (!lnodes) die("Cannot malloc space for local nodes.");
+    for (i=0;i<20;i++)
+    {
+      memcpy(lnodes[i].v,face[i],sizeof(face[i]));
+      lnodes[i].level=0;
+      lnodes[i].kids=0;
+    }
+  }
+  for (i=0;i<20;i++)
+    coarsen(i);
+  for (i=0;i<20;i++)
+    refinewanted(i);
+  while (closure()) ;
+  local.nTs=0;
+  for (i=0;i<20;i++)
+    flatten(i);
+}
+
 void animate()
 {
   // called by idle() - progressive draw new grid
@@ -150,66 +582,416 @@ void animate()
   }
 }
 
+int addnb(int *nb,int m,int j,int i)
+{
+  // add j to the m neighbours in nb of control volume i, unless it is i or
+  // already there; returns the new count
+  int k;
+  if (j==i) return m;
+  for (k=0;k<m;k++)
+    if (nb[k]==j) return m;
+  if (m==FIT) die("Cannot fit more neighbours in a stencil.");
+  nb[m]=j;
+  return m+1;
+}
+
+int attachshader(unsigned int prog,unsigned int kind,int n,char **src)
+{
+  // compile a shader from n source strings & attach it to prog; on failure,
+  // print the compiler's log & return 0
+  char log[2000];
+  GLint ok=0;
+  GLuint sh=glCreateShader(kind);
+  glShaderSource(sh,n,(const char **)src,NULL);
+  glCompileShader(sh);
+  glGetShaderiv(sh,GL_COMPILE_STATUS,&ok);
+  if (!ok)
+  {
+    glGetShaderInfoLog(sh,sizeof(log),NULL,log);
+    printf("Cannot compile shader:\n%s\n",log);
+  }
+  else
+    glAttachShader(prog,sh);
+  glDeleteShader(sh);
+  return ok;
+}
+
+int bench(int maxlvl)
+{
+  // headless operator benchmark: build grid levels up to maxlvl, then time
+  // each operator sweep at every level & report effective memory bandwidth,
+  // checking each operator against exact results for f=z & for solid-body
+  // rotation u=(-y,x,0): laplacian -2z/r^2, gradient (0,0,1)-z*x/r^2,
+  // divergence 0 & curl 2z/r (errors scaled by r to be dimensionless)
+  char *kinds[2]={"vertex","cell"};
+  double *f,*out,*u[3],*x,d,e,err,mean,ms,r,t;
+  double bpv[4];
+  int i,j,kind,lvl,op,reps;
+  char *ops[4]={"laplacian","gradient","divergence","curl"};
+  struct S st[2];
+  refinem=1;
+  animatem=0;
+  icosahedron();
+  while (level<maxlvl) upgrid();
+  r=radius;
+#ifdef _OPENMP
+  printf("operator benchmark, %d threads\n",omp_get_max_threads());
+#endif
+  for (lvl=0;lvl<=maxlvl;lvl++)
+  {
+    t=now();
+    buildstencils(lvl,&st[0],&st[1]);
+    printf("grid level %d: stencils built in %.1f ms\n",lvl,(now()-t)*1000);
+    for (kind=0;kind<2;kind++)
+    {
+      struct S *s=&st[kind];
+      f=(double *)malloc(s->n*sizeof(double));
+      out=(double *)malloc(3*s->n*sizeof(double));
+      for (j=0;j<3;j++)
+        u[j]=(double *)malloc(s->n*sizeof(double));
+      if (!f||!out||!u[0]||!u[1]||!u[2]) die("Cannot malloc space for fields.");
+      // f=z and u=solid-body rotation about the z axis, at control volumes
+      for (i=0;i<s->n;i++)
+      {
+        f[i]=s->x[3*i+2];
+        u[0][i]=-s->x[3*i+1];
+        u[1][i]=s->x[3*i];
+        u[2][i]=0;
+      }
+      // compulsory traffic per volume: coefficients, indices, own values
+      bpv[0]=s->w*(8+4)+8+8;
+      bpv[1]=s->w*(3*8+4)+8+3*8;
+      bpv[2]=s->w*(3*8+4)+3*8+3*8+8;
+      bpv[3]=s->w*(3*8+4)+3*8+8;
+      reps=1+20000000/(s->n*s->w);
+      for (op=0;op<4;op++)
+      {
+        switch(op)
+        {
+          case 0: oplaplacian(s,f,out); break;
+          case 1: opgradient(s,f,out,out+s->n,out+2*s->n); break;
+          case 2: opdivergence(s,u[0],u[1],u[2],out); break;
+          case 3: opcurl(s,u[0],u[1],u[2],out); break;
+        }
+        for (err=mean=0,i=0;i<s->n;i++)
+        {
+          x=&s->x[3*i];
+          switch(op)
+          {
+            case 0: e=fabs(out[i]+2*x[2]/(r*r))*r; break;
+            case 1:
+              for (e=0,j=0;j<3;j++)
+              {
+                d=out[j*s->n+i]-((j==2)-x[2]*x[j]/(r*r));
+                e+=d*d;
+              }
+              e=sqrt(e);
+              break;
+            case 2: e=fabs(out[i])*r; break;
+            case 3: e=fabs(out[i]-2*x[2]/r); break;
+          }
+          mean+=e/s->n;
+          if (e>err) err=e;
+        }
+        t=now();
+        for (i=0;i<reps;i++)
+          switch(op)
+          {
+            case 0: oplaplacian(s,f,out); break;
+            case 1: opgradient(s,f,out,out+s->n,out+2*s->n); break;
+            case 2: opdivergence(s,u[0],u[1],u[2],out); break;
+            case 3: opcurl(s,u[0],u[1],u[2],out); break;
+          }
+        ms=(now()-t)*1000/reps;
+        printf("  %-6s %-10s %8d volumes %10.4f ms %8.2f GB/s  error mean %.2e "
+               "max %.2e\n",kinds[kind],ops[op],s->n,ms,bpv[op]*s->n/(ms*1e6),
+               mean,err);
+      }
+      free(f);
+      free(out);
+      for (j=0;j<3;j++)
+        free(u[j]);
+      freestencil(s);
+    }
+  }
+  return 0;
+}
+
 void bisect()
 {
   // bisect the faces of triangles to produce new triangles
-  double m[3][3];
   int i;
+  tic(ST_BISECT);
   int nTsold=grid[level-1].nTs;
   int nTsnew=4*nTsold;
   struct T *Tpold=grid[level-1].Tp;
-  struct T *Tpnew=(struct T *)malloc(nTsnew*sizeof(struct T));
-  if (!Tpnew) die("Cannot malloc space for bisection triangles.");
+  struct T *Tpnew=levelbuf(level);
   grid[level].Tp=Tpnew;
-  grid[level].nTs=nTsnew;  
-  for (i=0;i<nTsold;i++,Tpnew+=4)
+  grid[level].nTs=nTsnew;
+  // threads write (and so first touch) the part of the level they refine
+#pragma omp parallel for schedule(static)
+  for (i=0;i<nTsold;i++)
   {
+    double m[3][3];
+    struct T *Tq=&Tpnew[4*i];
     midpoints(&Tpold[i],m);
     // new triangle 1
-    Tpnew[0].v[0][0]=Tpold[i].v[0][0];
-    Tpnew[0].v[0][1]=Tpold[i].v[0][1];
-    Tpnew[0].v[0][2]=Tpold[i].v[0][2];
-    Tpnew[0].v[1][0]=m[0][0];
-    Tpnew[0].v[1][1]=m[0][1];
-    Tpnew[0].v[1][2]=m[0][2];
-    Tpnew[0].v[2][0]=m[2][0];
-    Tpnew[0].v[2][1]=m[2][1];
-    Tpnew[0].v[2][2]=m[2][2];
+    Tq[0].v[0][0]=Tpold[i].v[0][0];
+    Tq[0].v[0][1]=Tpold[i].v[0][1];
+    Tq[0].v[0][2]=Tpold[i].v[0][2];
+    Tq[0].v[1][0]=m[0][0];
+    Tq[0].v[1][1]=m[0][1];
+    Tq[0].v[1][2]=m[0][2];
+    Tq[0].v[2][0]=m[2][0];
+    Tq[0].v[2][1]=m[2][1];
+    Tq[0].v[2][2]=m[2][2];
     // new triangle 2    
-    Tpnew[1].v[0][0]=m[0][0];
-    Tpnew[1].v[0][1]=m[0][1];
-    Tpnew[1].v[0][2]=m[0][2];
-    Tpnew[1].v[1][0]=Tpold[i].v[1][0];
-    Tpnew[1].v[1][1]=Tpold[i].v[1][1];
-    Tpnew[1].v[1][2]=Tpold[i].v[1][2];
-    Tpnew[1].v[2][0]=m[1][0];
-    Tpnew[1].v[2][1]=m[1][1];
-    Tpnew[1].v[2][2]=m[1][2];
+    Tq[1].v[0][0]=m[0][0];
+    Tq[1].v[0][1]=m[0][1];
+    Tq[1].v[0][2]=m[0][2];
+    Tq[1].v[1][0]=Tpold[i].v[1][0];
+    Tq[1].v[1][1]=Tpold[i].v[1][1];
+    Tq[1].v[1][2]=Tpold[i].v[1][2];
+    Tq[1].v[2][0]=m[1][0];
+    Tq[1].v[2][1]=m[1][1];
+    Tq[1].v[2][2]=m[1][2];
     // new triangle 3        
-    Tpnew[2].v[0][0]=m[2][0];
-    Tpnew[2].v[0][1]=m[2][1];
-    Tpnew[2].v[0][2]=m[2][2];
-    Tpnew[2].v[1][0]=m[1][0];
-    Tpnew[2].v[1][1]=m[1][1];
-    Tpnew[2].v[1][2]=m[1][2];
-    Tpnew[2].v[2][0]=Tpold[i].v[2][0];
-    Tpnew[2].v[2][1]=Tpold[i].v[2][1];
-    Tpnew[2].v[2][2]=Tpold[i].v[2][2];
+    Tq[2].v[0][0]=m[2][0];
+    Tq[2].v[0][1]=m[2][1];
+    Tq[2].v[0][2]=m[2][2];
+    Tq[2].v[1][0]=m[1][0];
+    Tq[2].v[1][1]=m[1][1];
+    Tq[2].v[1][2]=m[1][2];
+    Tq[2].v[2][0]=Tpold[i].v[2][0];
+    Tq[2].v[2][1]=Tpold[i].v[2][1];
+    Tq[2].v[2][2]=Tpold[i].v[2][2];
     // new triangle 4        
-    Tpnew[3].v[0][0]=m[0][0];
-    Tpnew[3].v[0][1]=m[0][1];
-    Tpnew[3].v[0][2]=m[0][2];
-    Tpnew[3].v[1][0]=m[1][0];
-    Tpnew[3].v[1][1]=m[1][1];
-    Tpnew[3].v[1][2]=m[1][2];
-    Tpnew[3].v[2][0]=m[2][0];
-    Tpnew[3].v[2][1]=m[2][1];
-    Tpnew[3].v[2][2]=m[2][2];
+    Tq[3].v[0][0]=m[0][0];
+    Tq[3].v[0][1]=m[0][1];
+    Tq[3].v[0][2]=m[0][2];
+    Tq[3].v[1][0]=m[1][0];
+    Tq[3].v[1][1]=m[1][1];
+    Tq[3].v[1][2]=m[1][2];
+    Tq[3].v[2][0]=m[2][0];
+    Tq[3].v[2][1]=m[2][1];
+    Tq[3].v[2][2]=m[2][2];
   }
+  toc(ST_BISECT); // normals & centroids are timed on their own
   set_ns_and_cs();
   animates=1;
 }
 
+void buildduals(struct T *Tp,struct M *tri,struct M *dual)
+{
+  // build the dual of a triangle mesh made from triangles Tp: one cell per
+  // vertex, whose corners are the centroids of the triangles around it,
+  // ordered counterclockwise as seen from outside the sphere
+  double a[VALENCE],d[3],e[3],x[3],*c,*v,ta;
+  int i,j,k,t,tp,*q;
+  int *cnt=(int *)calloc(tri->nv,sizeof(int));
+  if (!cnt) die("Cannot malloc space for dual cell counts.");
+  dual->nv=tri->np;
+  dual->np=tri->nv;
+  dual->v=(double *)malloc(3*dual->nv*sizeof(double));
+  dual->p=(int *)malloc(3*tri->np*sizeof(int));
+  dual->o=(int *)malloc((dual->np+1)*sizeof(int));
+  if (!dual->v||!dual->p||!dual->o) die("Cannot malloc space for dual mesh.");
+  for (i=0;i<tri->np;i++)
+    for (j=0;j<3;j++)
+    {
+      dual->v[3*i+j]=Tp[i].c[j];
+      ++cnt[tri->p[3*i+j]];
+    }
+  // turn counts into offsets, then slot each triangle in at its vertices
+  dual->o[0]=0;
+  for (i=0;i<tri->nv;i++)
+    dual->o[i+1]=dual->o[i]+cnt[i];
+  for (i=0;i<tri->np;i++)
+    for (j=0;j<3;j++)
+    {
+      k=tri->p[3*i+j];
+      dual->p[dual->o[k+1]-cnt[k]--]=i;
+    }
+  // sort each cell's corners by angle around its vertex (5 or 6 of them,
+  // or a few more where local refinement closes the mesh)
+  for (i=0;i<tri->nv;i++)
+  {
+    v=&tri->v[3*i];
+    q=&dual->p[dual->o[i]];
+    k=dual->o[i+1]-dual->o[i];
+    if (k>VALENCE) die("Unexpected vertex valence building dual mesh.");
+    for (t=0;t<k;t++)
+    {
+      c=&dual->v[3*q[t]];
+      for (j=0;j<3;j++)
+        d[j]=c[j]-v[j];
+      if (t==0)
+        for (j=0;j<3;j++)
+          e[j]=d[j];
+      x[0]=e[1]*d[2]-e[2]*d[1];
+      x[1]=e[2]*d[0]-e[0]*d[2];
+      x[2]=e[0]*d[1]-e[1]*d[0];
+      a[t]=atan2(x[0]*v[0]+x[1]*v[1]+x[2]*v[2],e[0]*d[0]+e[1]*d[1]+e[2]*d[2]);
+    }
+    for (t=1;t<k;t++)
+      for (j=t;j>0&&a[j-1]>a[j];j--)
+      {
+        ta=a[j]; a[j]=a[j-1]; a[j-1]=ta;
+        tp=q[j]; q[j]=q[j-1]; q[j-1]=tp;
+      }
+  }
+  free(cnt);
+}
+
+void buildglyphs()
+{
+  // render the printable characters once with glut and cache them in a
+  // texture, 16 per row, so the overlay costs a few quads instead of bitmaps;
+  // they are rendered off-screen, as the window may be small or obscured
+  int c;
+  int w=16*GLYPHW,h=8*GLYPHH;
+  unsigned char *image=(unsigned char *)malloc(w*h);
+  GLuint fbo,rbo;
+  if (!image) die("Cannot malloc space for glyph cache.");
+  glGenRenderbuffers(1,&rbo);
+  glBindRenderbuffer(GL_RENDERBUFFER,rbo);
+  glRenderbufferStorage(GL_RENDERBUFFER,GL_RGBA8,w,h);
+  glGenFramebuffers(1,&fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER,fbo);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER,GL_COLOR_ATTACHMENT0,
+                            GL_RENDERBUFFER,rbo);
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER)!=GL_FRAMEBUFFER_COMPLETE)
+    die("Cannot build glyph cache framebuffer.");
+  glClear(GL_COLOR_BUFFER_BIT);
+  glColor3dv(white);
+  for (c=32;c<127;c++)
+  {
+    glWindowPos2i(((c-32)%16)*GLYPHW,((c-32)/16)*GLYPHH+3);
+    glutBitmapCharacter(FONT,c);
+  }
+  glReadBuffer(GL_COLOR_ATTACHMENT0);
+  glPixelStorei(GL_PACK_ALIGNMENT,1);
+  glReadPixels(0,0,w,h,GL_RED,GL_UNSIGNED_BYTE,image);
+  glPixelStorei(GL_PACK_ALIGNMENT,4);
+  glBindFramebuffer(GL_FRAMEBUFFER,0);
+  glReadBuffer(GL_BACK);
+  glDeleteFramebuffers(1,&fbo);
+  glDeleteRenderbuffers(1,&rbo);
+  glGenTextures(1,&glyphs);
+  glBindTexture(GL_TEXTURE_2D,glyphs);
+  glPixelStorei(GL_UNPACK_ALIGNMENT,1);
+  glTexImage2D(GL_TEXTURE_2D,0,GL_ALPHA,w,h,0,GL_ALPHA,GL_UNSIGNED_BYTE,image);
+  glPixelStorei(GL_UNPACK_ALIGNMENT,4);
+  glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_NEAREST);
+  free(image);
+  errorcheck();
+}
+
+void buildmesh(struct T *Tp,int nTs,struct M *m)
+{
+  // index a grid's triangles by unique vertex, winding them outward; shared
+  // vertices are bitwise identical, since neighbouring triangles compute
+  // (or copy) them from the same edge endpoints, & a closed triangulated
+  // sphere has nTs/2+2 of them (Euler), which sizes the vertex array & the
+  // hash table (kept at most half full)
+  double a[3],b[3],*v;
+  int i,j,k,tmp,nv=nTs/2+2;
+  size_t h,mask=1;
+  int *table;
+  uint64_t bits[3];
+  while (mask<(size_t)2*nv) mask<<=1;
+  table=(int *)calloc(mask,sizeof(int));
+  m->v=(double *)malloc(3*(size_t)nv*sizeof(double));
+  m->p=(int *)malloc(3*(size_t)nTs*sizeof(int));
+  m->o=(int *)malloc((nTs+1)*sizeof(int));
+  if (!table||!m->v||!m->p||!m->o) die("Cannot malloc space for export mesh.");
+  --mask;
+  m->nv=0;
+  m->np=nTs;
+  for (i=0;i<nTs;i++)
+  {
+    m->o[i]=3*i;
+    for (j=0;j<3;j++)
+    {
+      // find or insert the vertex in an open-addressed hash table
+      v=Tp[i].v[j];
+      memcpy(bits,v,sizeof(bits));
+      h=(bits[0]*0x9E3779B97F4A7C15ULL^bits[1]*0xC2B2AE3D27D4EB4FULL^
+         bits[2]*0x165667B19E3779F9ULL)>>17;
+      for (h&=mask;table[h];h=(h+1)&mask)
+        if (!memcmp(&m->v[3*(table[h]-1)],v,sizeof(bits))) break;
+      if (!table[h])
+      {
+        if (m->nv==nv) die("Cannot export a mesh that isn't a closed surface.");
+        memcpy(&m->v[3*m->nv],v,sizeof(bits));
+        table[h]=++m->nv;
+      }
+      m->p[3*i+j]=table[h]-1;
+    }
+    // flip triangles whose winding would put their normal inward
+    for (k=0;k<3;k++)
+    {
+      a[k]=Tp[i].v[1][k]-Tp[i].v[0][k];
+      b[k]=Tp[i].v[2][k]-Tp[i].v[0][k];
+    }
+    if ((a[1]*b[2]-a[2]*b[1])*Tp[i].c[0]+(a[2]*b[0]-a[0]*b[2])*Tp[i].c[1]+
+        (a[0]*b[1]-a[1]*b[0])*Tp[i].c[2]<0)
+    {
+      tmp=m->p[3*i+1];
+      m->p[3*i+1]=m->p[3*i+2];
+      m->p[3*i+2]=tmp;
+    }
+  }
+  m->o[nTs]=3*nTs;
+  free(table);
+}
+
+void buildstencils(int lvl,struct S *vs,struct S *cs)
+{
+  // precompute operator coefficients at a grid level, for vertex-centred
+  // fields (at the vertices) and for cell-centred fields (at the triangle
+  // centroids); each volume's stencil is its neighbours out to two edges
+  // away, or the triangles sharing a corner with it, enough for a well
+  // posed quadratic fit even next to the 12 pentagons
+  int e,i,j,k,l,m,nb[FIT],*q,*r,w,v;
+  struct M dual,tri;
+  buildmesh(grid[lvl].Tp,gridsize(lvl),&tri);
+  buildduals(grid[lvl].Tp,&tri,&dual);
+  newstencil(vs,tri.nv,FIT,tri.v);
+  newstencil(cs,tri.np,12,dual.v);
+  for (i=0;i<vs->n;i++)
+  {
+    q=&dual.p[dual.o[i]];
+    w=dual.o[i+1]-dual.o[i];
+    for (m=e=0;e<w;e++)
+      for (j=0;j<3;j++)
+      {
+        // corners of the triangles around each vertex next to vertex i
+        v=tri.p[3*q[e]+j];
+        r=&dual.p[dual.o[v]];
+        for (k=0;k<dual.o[v+1]-dual.o[v];k++)
+          for (l=0;l<3;l++)
+            m=addnb(nb,m,tri.p[3*r[k]+l],i);
+      }
+    stencilfit(vs,i,nb,m);
+  }
+  for (i=0;i<cs->n;i++)
+  {
+    for (m=j=0;j<3;j++)
+    {
+      // each triangle around each corner of triangle i
+      v=tri.p[3*i+j];
+      q=&dual.p[dual.o[v]];
+      for (k=0;k<dual.o[v+1]-dual.o[v];k++)
+        m=addnb(nb,m,q[k],i);
+    }
+    stencilfit(cs,i,nb,m);
+  }
+  freemesh(&dual);
+  freemesh(&tri);
+}
+
 void centroid(double m[3][3],struct T* Tp)
 {
   // find the centroid of a triangle
@@ -218,6 +1000,68 @@ void centroid(double m[3][3],struct T* Tp)
   Tp->c[2]=(m[0][2]+m[1][2]+m[2][2])/3;
 }
 
+int closure()
+{
+  // refine leaves that would otherwise meet their neighbours with hanging
+  // nodes that green triangles cannot close: two or more split edges, or an
+  // edge split more than once; returns the number refined
+  int e,i,h,n=0,*v;
+  for (i=0;i<nlnodes;i++)
+  {
+    if (lnodes[i].kids||lnodes[i].level<0) continue;
+    v=lnodes[i].v;
+    for (e=0,h=0;e<3;e++)
+      if (splitp(v[e],v[(e+1)%3]))
+      {
+        ++h;
+        if (splitp(v[e],lmid(v[e],v[(e+1)%3]))||
+            splitp(lmid(v[e],v[(e+1)%3]),v[(e+1)%3])) h=3;
+      }
+    if (h>1)
+    {
+      splitnode(i);
+      ++n;
+    }
+  }
+  return n;
+}
+
+int cmpd(const void *a,const void *b)
+{
+  // compare doubles for qsort()
+  double x=*(double *)a,y=*(double *)b;
+  return x<y?-1:x>y;
+}
+
+int cmpl(const void *a,const void *b)
+{
+  // compare longs for qsort()
+  long x=*(long *)a,y=*(long *)b;
+  return x<y?-1:x>y;
+}
+
+int cmpt(const void *a,const void *b)
+{
+  // compare triangles (sorted vertex index triples) for qsort()
+  int i,*x=(int *)a,*y=(int *)b;
+  for (i=0;i<2&&x[i]==y[i];i++) ;
+  return x[i]<y[i]?-1:x[i]>y[i];
+}
+
+void coarsen(int i)
+{
+  // prune the children of node i if it shouldn't be refined, else look
+  // further down; this leaves just the nodes refinewanted() would refine
+  // from scratch, so coarsening & refining again is repeatable
+  int k;
+  if (!lnodes[i].kids) return;
+  if (lnodes[i].level<wantlevel(i))
+    for (k=0;k<4;k++)
+      coarsen(lnodes[i].kids+k);
+  else
+    prune(i);
+}
+
 void die(char *msg)
 {
   // print informative message and exit with error code
@@ -229,7 +1073,10 @@ void display()
 {
   // process visual elements
   double ex=0,ey=0,ez=0,m=PI/180;
+  double t0=timingp()?now():0;
   float lightradius=6;
+  ntris=nverts=0;
+  if (hudp&&!glyphs) buildglyphs(); // build overlay font cache (once)
   glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
   glEnable(GL_DEPTH_TEST); // enable z-buffer
   glLoadIdentity();
@@ -261,27 +1108,38 @@ void display()
   glLightfv(GL_LIGHT0,GL_POSITION,lightpos);
   glEnable(GL_LIGHT0);
   // draw geodesic grid
-  if (animatep) // if animation is enabled...
+  tic(ST_GRID);
+  if (tessp) // shader mode replaces the grid
+    tessdraw(facecolor,black);
+  else if (localp) // local refinement replaces the grid
+    drawgrid(&local,facecolor,black);
+  else if (fieldp&&field.shown&&level==field.level&&!animatep&&!animates)
+    fielddraw(black); // the streamed field colors the grid
+  else if (animatep) // if animation is enabled...
   {
     if (animates) // bisection is done: draw extended grid
     {
       setfc(yellow);
-      drawgrid(level-1,yellow,black);
-      drawgrid(level,yellow,red);
+      drawgrid(&grid[level-1],yellow,black);
+      drawgrid(&grid[level],yellow,red);
     }
     else // draw bisected grid
     {
-      drawgrid(level-1,yellow,black);
-      drawgrid(level,red,black);
+      drawgrid(&grid[level-1],yellow,black);
+      drawgrid(&grid[level],red,black);
     }
   }
   else
     if (animates) // bisection done, no animation      
-      drawgrid(level,facecolor,red);
+      drawgrid(&grid[level],facecolor,red);
     else // extension done, no animation
-      drawgrid(level,facecolor,black);
-  if (centroidsp) drawcentroids(); // draw centroids (maybe)
-  if (normalsp) drawnormals();     // draw normals (maybe)
+      drawgrid(&grid[level],facecolor,black);
+  toc(ST_GRID);
+  if (!tessp) // shader mode's grid has no cpu centroids or normals
+  {
+    if (centroidsp) drawcentroids(); // draw centroids (maybe)
+    if (normalsp) drawnormals();     // draw normals (maybe)
+  }
   glDepthMask(0);                  // make z-buffer read-only
 // glDisable(GL_DEPTH_TEST); // w/o this, weird splotches at some vertices at g3+
   if (spherep) shellsphere();      // show translucent sphere (maybe)
@@ -290,9 +1148,11 @@ void display()
   glDisable(GL_DEPTH_TEST);        // disable z-buffer
   if (textp) drawtext();           // draw text (maybe)
   if (axesp) drawaxes();           // draw axes (maybe)
+  if (hudp) drawhud();             // draw instrumentation overlay (maybe)
   glFlush();                       // get stuff drawn now
   glutSwapBuffers();               // enable redrawn buffer
   errorcheck();                    // see if we encountered any errors
+  if (timingp()) endframe(t0);     // record frame timings (maybe)
 }
 
 double distance(double x1,double y1,double z1,double x2,double y2,double z2)
@@ -331,15 +1191,20 @@ void drawcentroids()
 {
   // show centroids of triangles
   int i;
-  struct T *Tp=grid[level].Tp;
+  struct G *Gp=shown();
+  struct T *Tp=Gp->Tp;
+  tic(ST_CENTROIDS);
   glColor3dv(springgreen);
-  for (i=0;i<grid[level].nTs;i++)
+  for (i=0;i<Gp->nTs;i++)
   {
     glPushMatrix();
     glTranslated(Tp[i].c[0],Tp[i].c[1],Tp[i].c[2]);
     glutSolidSphere(.05,10,10);
     glPopMatrix();
   }
+  ntris+=Gp->nTs*2*10*10; // roughly, per glut's slices & stacks
+  nverts+=Gp->nTs*2*11*10;
+  toc(ST_CENTROIDS);
 }
 
 void drawchars(char *str,int ypos)
@@ -351,14 +1216,14 @@ void drawchars(char *str,int ypos)
     glutBitmapCharacter(FONT,*c);
 }
 
-void drawgrid(int lvl,double facec[3],double edgec[3])
+void drawgrid(struct G *Gp,double facec[3],double edgec[3])
 {
   // construct geodesic grid from triangles
   int i,j;
-  struct T *Tp=grid[lvl].Tp;
+  struct T *Tp=Gp->Tp;
   glColorMaterial(GL_FRONT_AND_BACK,GL_AMBIENT_AND_DIFFUSE);
   glEnable(GL_COLOR_MATERIAL);
-  for (i=0;i<grid[lvl].nTs;i++)
+  for (i=0;i<Gp->nTs;i++)
   {
     // draw triangle
     glColor3dv(facec);
@@ -380,6 +1245,91 @@ void drawgrid(int lvl,double facec[3],double edgec[3])
       glEnd();
     }
   }
+  ntris+=Gp->nTs;
+  nverts+=Gp->nTs*(edgesp?6:3);
+}
+
+void drawhud()
+{
+  // show instrumentation overlay in upper-left corner, from the glyph cache
+  char str[200];
+  double f[FRAMES],mean=0;
+  int i,s,y;
+  int n=framen<FRAMES?framen:FRAMES;
+  int w=glutGet(GLUT_WINDOW_WIDTH),h=glutGet(GLUT_WINDOW_HEIGHT);
+  long bytes,held,total=0,totalheld=0;
+  for (i=0;i<n;i++)
+    mean+=(f[i]=frametimes[i]);
+  qsort(f,n,sizeof(double),cmpd);
+  glMatrixMode(GL_PROJECTION);
+  glPushMatrix();
+  glLoadIdentity();
+  glOrtho(0,w,0,h,-1,1);
+  glMatrixMode(GL_MODELVIEW);
+  glPushMatrix();
+  glLoadIdentity();
+  glBindTexture(GL_TEXTURE_2D,glyphs);
+  glTexEnvi(GL_TEXTURE_ENV,GL_TEXTURE_ENV_MODE,GL_MODULATE);
+  glEnable(GL_TEXTURE_2D);
+  glBlendFunc(GL_SRC_ALPHA,GL_ONE_MINUS_SRC_ALPHA);
+  glEnable(GL_BLEND);
+  glColor3dv(yellow);
+  glBegin(GL_QUADS);
+  y=h-GLYPHH-5;
+  if (n>0)
+    sprintf(str,"%.1f fps | frame ms: p50 %.2f p95 %.2f p99 %.2f | cost %.2f",
+            1000*n/mean,f[n/2],f[(n*95)/100],f[(n*99)/100],framecost);
+  else
+    sprintf(str,"fps: measuring...");
+  hudchars(str,5,y);
+  for (s=0;s<STAGES;s++)
+  {
+    if (s<ST_BISECT)
+      sprintf(str,"%-14s %9.3f ms cpu %9.3f ms gpu",stagenames[s],
+              stagelast[s],stagegpu[s]);
+    else
+      sprintf(str,"%-14s %9.3f ms cpu",stagenames[s],stagelast[s]);
+    hudchars(str,5,y-=GLYPHH);
+  }
+  sprintf(str,"submitted: %ld triangles, %ld vertices",ntrislast,nvertslast);
+  hudchars(str,5,y-=GLYPHH);
+  if (field.name)
+  {
+    pthread_mutex_lock(&field.lock); // the reader thread counts reads
+    sprintf(str,"field: %ld timesteps read, %ld shown",field.read,field.shown);
+    pthread_mutex_unlock(&field.lock);
+    hudchars(str,5,y-=GLYPHH);
+  }
+  // levels above the current one stay resident after downgrid(), so
+  // report every level that holds memory, not just those in use
+  for (i=0;i<GRIDS;i++)
+  {
+    bytes=i<=level?(long)gridsize(i)*sizeof(struct T):0;
+    held=resident(i);
+    total+=bytes;
+    totalheld+=held;
+    if (!bytes&&!held) continue;
+    sprintf(str,"level %2d: %10ld bytes in use, %10ld resident",i,bytes,held);
+    hudchars(str,5,y-=GLYPHH);
+  }
+  sprintf(str,"total: %10ld in use, %10ld resident, %ld reserved",total,
+          totalheld,(long)arenasize);
+  hudchars(str,5,y-=GLYPHH);
+  if (localp)
+  {
+    // the local grid & the tree it is flattened from live outside the arena
+    bytes=(long)nlocal*sizeof(struct T)+(long)maxlnodes*sizeof(struct A)+
+          (long)maxlverts*sizeof(*lverts)+(long)maxledges*sizeof(struct H);
+    sprintf(str,"local: %10ld bytes, %d triangles",bytes,shown()->nTs);
+    hudchars(str,5,y-=GLYPHH);
+  }
+  glEnd();
+  glDisable(GL_BLEND);
+  glDisable(GL_TEXTURE_2D);
+  glPopMatrix();
+  glMatrixMode(GL_PROJECTION);
+  glPopMatrix();
+  glMatrixMode(GL_MODELVIEW);
 }
 
 void drawnormals()
@@ -387,9 +1337,11 @@ void drawnormals()
   // show normals to polyhedron faces
   int i,j;
   double cn[3];
-  struct T *Tp=grid[level].Tp;
+  struct G *Gp=shown();
+  struct T *Tp=Gp->Tp;
+  tic(ST_NORMALS);
   glColor3dv(magenta);
-  for (i=0;i<grid[level].nTs;i++)
+  for (i=0;i<Gp->nTs;i++)
   {
     glBegin(GL_LINES);
     {
@@ -400,43 +1352,144 @@ void drawnormals()
     }
     glEnd();
   }
+  nverts+=Gp->nTs*2;
+  toc(ST_NORMALS);
 }
 
 void drawtext()
 {
   // show some text in lower-left corner
   char str[1000];
+  tic(ST_TEXT);
   glColor3dv(white);
-  if (level==0)
+  if (tessp)
+    sprintf(str,"shader level %.2f - %s",tessl,
+            tessl!=tesstarget?"morphing...":"complete");
+  else if (level==0)
     sprintf(str,"grid level 0 - initial icosahedron");
   else if (animates)
     sprintf(str,"grid level %d - %s",level,animatep?"bisecting...":"bisected");
   else
     sprintf(str,"grid level %d - %s",level,animatep?"extending...":"complete");
+  if (tessp) // the cpu grid's annotations don't apply in shader mode
+    sprintf(str+strlen(str)," | [l]ocal n/a");
+  else if (localp)
+    sprintf(str+strlen(str)," | [l]ocal + (%d triangles, %d regions)",local.nTs,
+            nregions);
+  else
+    sprintf(str+strlen(str)," | [l]ocal -");
+  sprintf(str+strlen(str)," | s[h]ader %s",tessp?"+":"-");
+  if (field.name)
+    sprintf(str+strlen(str)," | [v]alues %s",fieldp?"+":"-");
   drawchars(str,55);
   sprintf(str,"[a]xes %s | [c]entroids %s | [e]dges %s | [f]ixed %s | [g]o %s | ani[m]ate %s",
-          axesp?"+":"-",centroidsp?"+":"-",edgesp?"+":"-",fixedp?"+":"-",
+          axesp?"+":"-",tessp?"n/a":centroidsp?"+":"-",edgesp?"+":"-",fixedp?"+":"-",
           play?"+":"-",animatem?"+":"-");
   drawchars(str,35);
-  sprintf(str,"[n]ormals %s | [r]efine %s | [s]phere %s | [t]exture %d",
-          normalsp?"+":"-",refinem?"1-step":"2-step",spherep?"+":"-",texturen); 
+  sprintf(str,"[i]nfo %s | [n]ormals %s | [r]efine %s | [s]phere %s | [t]exture %d",
+          hudp?"+":"-",tessp?"n/a":normalsp?"+":"-",refinem?"1-step":"2-step",spherep?"+":"-",
+          texturen);
   drawchars(str,20);
   sprintf(str,"zoom: [+-] | grid [<>] | rotate: arrows | reset angles: [0] | quit: <esc>");
   drawchars(str,5);
+  toc(ST_TEXT);
 }
 
 void downgrid()
 {
-  // reduce grid refinement & deallocate memory
+  // reduce grid refinement; the level's buffer stays in the arena for reuse
   animatep=0;
   animates=0;
-  free(grid[level].Tp);
   grid[level].Tp=NULL;
   grid[level].nTs=-1;
   --level;
   setfc(deffc);
 }
 
+void dumptrace()
+{
+  // write the frame trace as csv (registered with atexit)
+  FILE *f;
+  int i,s;
+  if (!tracen) return;
+  f=strcmp(tracename,"-")?fopen(tracename,"w"):stdout;
+  if (!f)
+  {
+    printf("Cannot open trace file %s.\n",tracename);
+    return;
+  }
+  fprintf(f,"t,frame_ms,level,triangles,vertices");
+  for (s=0;s<STAGES;s++)
+    fprintf(f,",%s_cpu_ms",stagenames[s]);
+  for (s=0;s<ST_BISECT;s++)
+    fprintf(f,",%s_gpu_ms",stagenames[s]);
+  fprintf(f,"\n");
+  for (i=0;i<tracen;i++)
+  {
+    fprintf(f,"%.6f,%.4f,%d,%ld,%ld",trace[i].t,trace[i].ms,trace[i].level,
+            trace[i].tris,trace[i].verts);
+    for (s=0;s<STAGES;s++)
+      fprintf(f,",%.4f",trace[i].st[s]);
+    for (s=0;s<ST_BISECT;s++)
+      fprintf(f,",%.4f",trace[i].gpu[s]);
+    fprintf(f,"\n");
+  }
+  if (f!=stdout) fclose(f);
+}
+
+void endrecord()
+{
+  // mark the tick at which the recorded session ended (registered with atexit)
+  record('e',0);
+  fclose(recordf);
+}
+
+void endframe(double t0)
+{
+  // record timings & submission counts for the frame started at t0
+  int s;
+  struct R *Rp;
+  double t1=now();
+  GLuint64 ns;
+  if (lastframe>0) frametimes[framen++%FRAMES]=(t0-lastframe)*1000;
+  if (firstframe<0) firstframe=t0;
+  lastframe=t0;
+  framecost=(t1-t0)*1000;
+  ntrislast=ntris;
+  nvertslast=nverts;
+  // refinement stages keep their last cost until they run again
+  for (s=0;s<STAGES;s++)
+    if (s<ST_BISECT||stagecur[s]>0) stagelast[s]=stagecur[s];
+  // the gpu has had a frame to finish the other set of drawing queries
+  stageq=1-stageq;
+  for (s=0;s<ST_BISECT;s++)
+  {
+    stagegpu[s]=0;
+    if (!stageran[stageq][s]) continue;
+    glGetQueryObjectui64v(stagequeries[stageq][s],GL_QUERY_RESULT,&ns);
+    stagegpu[s]=ns/1e6;
+    stageran[stageq][s]=0;
+  }
+  if (tracename)
+  {
+    if (tracen==tracemax)
+    {
+      tracemax=tracemax?2*tracemax:1024;
+      trace=(struct R *)realloc(trace,tracemax*sizeof(struct R));
+      if (!trace) die("Cannot realloc space for trace records.");
+    }
+    Rp=&trace[tracen++];
+    Rp->t=t0-firstframe;
+    Rp->ms=framecost;
+    Rp->level=level;
+    Rp->tris=ntris;
+    Rp->verts=nverts;
+    memcpy(Rp->st,stagecur,sizeof(stagecur));
+    memcpy(Rp->gpu,stagegpu,sizeof(stagegpu));
+  }
+  memset(stagecur,0,sizeof(stagecur));
+}
+
 void errorcheck()
 {
   // query opengl for errors: inform & exit if found
@@ -448,6 +1501,89 @@ void errorcheck()
   }
 }
 
+void export(int dualp)
+{
+  // write the grid on display (and maybe its dual cells) to disk; shader
+  // mode's grid is never built on the cpu, so it can't be exported
+  char name[100],*kind=localp?"-local":"";
+  struct M dual,tri;
+  struct G *Gp=shown();
+  if (tessp)
+  {
+    printf("Cannot export in shader mode; leave it with h first.\n");
+    return;
+  }
+  buildmesh(Gp->Tp,localp?Gp->nTs:gridsize(level),&tri);
+  sprintf(name,"icos-g%d%s.%s",level,kind,exportfmts[exportfmt]);
+  exportmesh(&tri,name);
+  if (dualp)
+  {
+    buildduals(Gp->Tp,&tri,&dual);
+    sprintf(name,"icos-g%d%s-dual.%s",level,kind,exportfmts[exportfmt]);
+    exportmesh(&dual,name);
+    freemesh(&dual);
+  }
+  freemesh(&tri);
+}
+
+void exportmesh(struct M *m,char *name)
+{
+  // stream a mesh to a file in the selected format
+  int i,j;
+  unsigned char nc;
+  uint16_t one=1;
+  struct W w;
+  wopen(&w,name);
+  switch(exportfmt)
+  {
+    case 0: // binary ply, in host byte order
+      wprintf(&w,"ply\nformat binary_%s_endian 1.0\ncomment icos grid\n"
+              "element vertex %d\nproperty double x\nproperty double y\n"
+              "property double z\nelement face %d\n"
+              "property list uchar int vertex_indices\nend_header\n",
+              *(unsigned char *)&one?"little":"big",m->nv,m->np);
+      wbytes(&w,m->v,3*m->nv*sizeof(double));
+      for (i=0;i<m->np;i++)
+      {
+        nc=m->o[i+1]-m->o[i];
+        wbytes(&w,&nc,1);
+        wbytes(&w,&m->p[m->o[i]],nc*sizeof(int));
+      }
+      break;
+    case 1: // obj, which is text only
+      wprintf(&w,"# icos grid\n");
+      for (i=0;i<m->nv;i++)
+        wprintf(&w,"v %.17g %.17g %.17g\n",m->v[3*i],m->v[3*i+1],m->v[3*i+2]);
+      for (i=0;i<m->np;i++)
+      {
+        wprintf(&w,"f");
+        for (j=m->o[i];j<m->o[i+1];j++)
+          wprintf(&w," %d",m->p[j]+1);
+        wprintf(&w,"\n");
+      }
+      break;
+    case 2: // legacy vtk unstructured grid, binary (always big-endian)
+      wprintf(&w,"# vtk DataFile Version 3.0\nicos grid\nBINARY\n"
+              "DATASET UNSTRUCTURED_GRID\nPOINTS %d double\n",m->nv);
+      for (i=0;i<3*m->nv;i++)
+        wbe64(&w,m->v[i]);
+      wprintf(&w,"\nCELLS %d %d\n",m->np,m->np+m->o[m->np]);
+      for (i=0;i<m->np;i++)
+      {
+        wbe32(&w,m->o[i+1]-m->o[i]);
+        for (j=m->o[i];j<m->o[i+1];j++)
+          wbe32(&w,m->p[j]);
+      }
+      wprintf(&w,"\nCELL_TYPES %d\n",m->np);
+      for (i=0;i<m->np;i++)
+        wbe32(&w,m->o[i+1]-m->o[i]==3?5:7); // VTK_TRIANGLE or VTK_POLYGON
+      wprintf(&w,"\n");
+      break;
+  }
+  wclose(&w);
+  printf("Exported %d vertices & %d polygons to %s.\n",m->nv,m->np,name);
+}
+
 void extend_vertex(struct T *Tp)
 {
   // position new vertex at correct radius from origin
@@ -469,12 +1605,320 @@ void extend()
 {
   // extend new vertices to correct radius
   int i;
+  tic(ST_EXTEND);
+#pragma omp parallel for schedule(static)
   for (i=0;i<grid[level].nTs;i++)
     extend_vertex(&grid[level].Tp[i]);
+  toc(ST_EXTEND); // normals & centroids are timed on their own
   set_ns_and_cs();
   animates=0;
 }
 
+void fielddraw(double edgec[4])
+{
+  // draw the newest streamed timestep on the field's grid level, each cell
+  // color-mapped in the fragment shader from its slot, then fence the slot
+  // so that fieldtake() won't hand it back for writing while still in use
+  double m=PI/180;
+  glUseProgram(field.prog);
+  glBindTexture(GL_TEXTURE_BUFFER,field.tex[field.front]);
+  glUniform1f(glGetUniformLocation(field.prog,"lo"),field.lo);
+  glUniform1f(glGetUniformLocation(field.prog,"hi"),field.hi);
+  glUniform3f(glGetUniformLocation(field.prog,"light"),6*cos(la*m),0,6*sin(la*m));
+  glUniform4f(glGetUniformLocation(field.prog,"edgecolor"),edgec[0],edgec[1],edgec[2],1);
+  glUniform1i(glGetUniformLocation(field.prog,"edges"),edgesp);
+  glBindBuffer(GL_ARRAY_BUFFER,field.vbo);
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glVertexPointer(3,GL_FLOAT,0,NULL);
+  glEnable(GL_CULL_FACE);
+  glDrawArrays(GL_TRIANGLES,0,3*field.n);
+  glDisable(GL_CULL_FACE);
+  glDisableClientState(GL_VERTEX_ARRAY);
+  glBindBuffer(GL_ARRAY_BUFFER,0);
+  glBindTexture(GL_TEXTURE_BUFFER,0);
+  glUseProgram(0);
+  if (field.fence[field.front]) glDeleteSync(field.fence[field.front]);
+  field.fence[field.front]=glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE,0);
+  ntris+=field.n;
+  nverts+=3*field.n;
+}
+
+int fieldget(void *buf,size_t bytes)
+{
+  // read exactly bytes from the field stream (0 => it ended first)
+  char *p=(char *)buf;
+  ssize_t got;
+  while (bytes)
+  {
+    got=read(field.fd,p,bytes);
+    if (got<0&&errno==EINTR) continue;
+    if (got<=0) return 0;
+    p+=got;
+    bytes-=got;
+  }
+  return 1;
+}
+
+void fieldopen()
+{
+  // open the field stream given with -s & read its grid level, refine the
+  // grid to that level, then set up the shaders, the slots & the reader
+  char *ver=(char *)glGetString(GL_VERSION);
+  double a[3],b[3];
+  float *v;
+  int i,j,k,major=0,minor=0,oldm=animatem,oldr=refinem,out;
+  int32_t lvl;
+  size_t bytes;
+  struct stat st;
+  struct T *Tp;
+  GLbitfield flags=GL_MAP_WRITE_BIT|GL_MAP_PERSISTENT_BIT|GL_MAP_COHERENT_BIT;
+  GLint align,maxtexels;
+  pthread_t reader;
+  if (ver) sscanf(ver,"%d.%d",&major,&minor);
+  if (major*10+minor<44) die("Cannot stream a field without OpenGL 4.4.");
+  if ((field.fd=open(field.name,O_RDONLY))<0) die("Cannot open field stream.");
+  if (!fieldget(&lvl,sizeof(lvl))) die("Cannot read field stream level.");
+  if (lvl<0||lvl>levels) die("Field stream level out of range.");
+  field.level=lvl;
+  field.n=20<<(2*lvl);
+  if (fstat(field.fd,&st)) die("Cannot stat field stream.");
+  field.pace=S_ISREG(st.st_mode);
+  if (field.pace&&st.st_size<sizeof(lvl)+(off_t)field.n*sizeof(float))
+    die("Cannot find a whole timestep in field file.");
+  glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE,&maxtexels);
+  if (maxtexels<field.n) die("Cannot fit a field timestep in a texture buffer.");
+  // refine the grid to the field's level, all at once
+  animatem=0;
+  refinem=1;
+  while (level<field.level)
+    upgrid();
+  animatem=oldm;
+  refinem=oldr;
+  field.prog=glCreateProgram();
+  if (!attachshader(field.prog,GL_VERTEX_SHADER,1,&fieldglsl[0])||
+      !attachshader(field.prog,GL_FRAGMENT_SHADER,1,&fieldglsl[1])||
+      !linkprogram(field.prog))
+    die("Cannot build field shaders.");
+  // cell corners, in grid order so that gl_PrimitiveID is the cell index,
+  // wound outward so that the far side can be culled
+  v=(float *)malloc((size_t)field.n*9*sizeof(float));
+  if (!v) die("Cannot malloc space for field cells.");
+  for (i=0;i<field.n;i++)
+  {
+    Tp=&grid[lvl].Tp[i];
+    for (k=0;k<3;k++)
+    {
+      a[k]=Tp->v[1][k]-Tp->v[0][k];
+      b[k]=Tp->v[2][k]-Tp->v[0][k];
+    }
+    out=(a[1]*b[2]-a[2]*b[1])*Tp->v[0][0]+(a[2]*b[0]-a[0]*b[2])*Tp->v[0][1]+
+        (a[0]*b[1]-a[1]*b[0])*Tp->v[0][2]>0;
+    for (j=0;j<3;j++)
+      for (k=0;k<3;k++)
+        v[9*i+3*j+k]=Tp->v[out||!j?j:3-j][k];
+  }
+  glGenBuffers(1,&field.vbo);
+  glBindBuffer(GL_ARRAY_BUFFER,field.vbo);
+  glBufferData(GL_ARRAY_BUFFER,(size_t)field.n*9*sizeof(float),v,GL_STATIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER,0);
+  free(v);
+  // the slots: one persistently mapped buffer, a texture buffer view of each
+  glGetIntegerv(GL_TEXTURE_BUFFER_OFFSET_ALIGNMENT,&align);
+  if (align<(GLint)sizeof(float)) align=sizeof(float);
+  bytes=(field.n*sizeof(float)+align-1)/align*align;
+  field.stride=bytes/sizeof(float);
+  glGenBuffers(1,&field.buf);
+  glBindBuffer(GL_TEXTURE_BUFFER,field.buf);
+  glBufferStorage(GL_TEXTURE_BUFFER,SLOTS*bytes,NULL,flags);
+  field.map=(float *)glMapBufferRange(GL_TEXTURE_BUFFER,0,SLOTS*bytes,flags);
+  if (!field.map) die("Cannot map field buffer.");
+  glGenTextures(SLOTS,field.tex);
+  for (i=0;i<SLOTS;i++)
+  {
+    glBindTexture(GL_TEXTURE_BUFFER,field.tex[i]);
+    glTexBufferRange(GL_TEXTURE_BUFFER,GL_R32F,field.buf,i*bytes,
+                     field.n*sizeof(float));
+    field.fence[i]=0;
+  }
+  glBindTexture(GL_TEXTURE_BUFFER,0);
+  glBindBuffer(GL_TEXTURE_BUFFER,0);
+  errorcheck();
+  field.back=0;
+  field.mid=1;
+  field.front=2;
+  pthread_mutex_init(&field.lock,NULL);
+  pthread_cond_init(&field.taken,NULL);
+  if (pthread_create(&reader,NULL,fieldreader,NULL))
+    die("Cannot start field reader.");
+  pthread_detach(reader);
+  fieldp=1;
+}
+
+void *fieldreader(void *arg)
+{
+  // reader thread: stream timesteps into the back slot through a small
+  // staging chunk, noting their value range on the way, then publish each
+  // by swapping it with the middle slot; files loop & wait for every
+  // timestep to be taken, pipes run ahead & newer timesteps replace older
+  static float chunk[FIELDCHUNK];
+  float lo,hi,*dst;
+  int i,j,m,tmp;
+  for (;;)
+  {
+    dst=field.map+(size_t)field.back*field.stride;
+    lo=FLT_MAX;
+    hi=-FLT_MAX;
+    for (i=0;i<field.n;i+=m)
+    {
+      m=field.n-i<FIELDCHUNK?field.n-i:FIELDCHUNK;
+      if (!fieldget(chunk,m*sizeof(float)))
+      {
+        if (!field.pace||i) // a pipe closed, or a file ends mid-timestep
+        {
+          printf("Field stream ended after %ld timesteps.\n",field.read);
+          return NULL;
+        }
+        lseek(field.fd,sizeof(int32_t),SEEK_SET); // rewind past the level
+        m=0;
+        continue;
+      }
+      for (j=0;j<m;j++)
+      {
+        if (chunk[j]<lo) lo=chunk[j];
+        if (chunk[j]>hi) hi=chunk[j];
+      }
+      memcpy(dst+i,chunk,m*sizeof(float));
+    }
+    pthread_mutex_lock(&field.lock);
+    while (field.pace&&field.fresh)
+      pthread_cond_wait(&field.taken,&field.lock);
+    field.range[field.back][0]=lo;
+    field.range[field.back][1]=hi;
+    tmp=field.back;
+    field.back=field.mid;
+    field.mid=tmp;
+    field.fresh=1;
+    ++field.read;
+    pthread_mutex_unlock(&field.lock);
+  }
+}
+
+void fieldtake()
+{
+  // called by idle(): swap the newest complete timestep in for drawing,
+  // unless the gpu is still reading the slot being given back, in which
+  // case leave it for a later tick rather than block
+  int fresh,tmp;
+  GLenum status;
+  pthread_mutex_lock(&field.lock);
+  fresh=field.fresh;
+  pthread_mutex_unlock(&field.lock);
+  if (!fresh) return;
+  if (field.fence[field.front])
+  {
+    status=glClientWaitSync(field.fence[field.front],
+                            GL_SYNC_FLUSH_COMMANDS_BIT,0);
+    if (status==GL_WAIT_FAILED) die("Cannot poll field fence.");
+    if (status==GL_TIMEOUT_EXPIRED) return;
+    glDeleteSync(field.fence[field.front]);
+    field.fence[field.front]=0;
+  }
+  pthread_mutex_lock(&field.lock);
+  tmp=field.front;
+  field.front=field.mid;
+  field.mid=tmp;
+  field.fresh=0;
+  if (!field.shown||field.range[field.front][0]<field.lo)
+    field.lo=field.range[field.front][0];
+  if (!field.shown||field.range[field.front][1]>field.hi)
+    field.hi=field.range[field.front][1];
+  ++field.shown;
+  pthread_cond_signal(&field.taken);
+  pthread_mutex_unlock(&field.lock);
+}
+
+void flatten(int i)
+{
+  // append the leaves under node i to the local grid, closing any one edge
+  // with a hanging node by splitting the leaf in two (green) triangles
+  double m[3][3];
+  int e,k,*v=lnodes[i].v;
+  struct T *Tp;
+  if (lnodes[i].kids)
+  {
+    for (k=0;k<4;k++)
+      flatten(lnodes[i].kids+k);
+    return;
+  }
+  if (local.nTs+2>nlocal)
+  {
+    nlocal=nlocal?2*nlocal:1024;
+    local.Tp=(struct T *)realloc(local.Tp,nlocal*sizeof(struct T));
+    if (!local.Tp) die("Cannot realloc space for local grid.");
+  }
+  for (e=0;e<3&&!splitp(v[e],v[(e+1)%3]);e++) ;
+  for (k=0;k<(e<3?2:1);k++)
+  {
+    Tp=&local.Tp[local.nTs++];
+    memcpy(Tp->v[0],lverts[v[0]],sizeof(Tp->v[0]));
+    memcpy(Tp->v[1],lverts[v[1]],sizeof(Tp->v[1]));
+    memcpy(Tp->v[2],lverts[v[2]],sizeof(Tp->v[2]));
+    if (e<3) // replace one end of the split edge with its midpoint
+      memcpy(Tp->v[(e+k)%3],lverts[lmid(v[e],v[(e+1)%3])],sizeof(Tp->v[0]));
+    midpoints(Tp,m);
+    normal(Tp,m);
+  }
+}
+
+void freemesh(struct M *m)
+{
+  // release an export mesh
+  free(m->v);
+  free(m->p);
+  free(m->o);
+}
+
+void freestencil(struct S *s)
+{
+  // release stencil arrays
+  int j;
+  free(s->x);
+  free(s->nb);
+  free(s->lap);
+  for (j=0;j<3;j++)
+  {
+    free(s->g[j]);
+    free(s->t[j]);
+  }
+}
+
+int gridsize(int lvl)
+{
+  // number of triangles in a grid level, even while animate() reveals it
+  return (lvl==level&&animatep==2)?animaten:grid[lvl].nTs;
+}
+
+void hudchars(char *str,int x,int y)
+{
+  // emit one textured quad per character, within glBegin(GL_QUADS)
+  unsigned char *c;
+  double u,v;
+  for (c=(unsigned char *)str;*c;c++,x+=GLYPHW)
+  {
+    if (*c<32||*c>126) continue;
+    u=((*c-32)%16)/16.0;
+    v=((*c-32)/16)/8.0;
+    glTexCoord2d(u,v);
+    glVertex2i(x,y);
+    glTexCoord2d(u+1/16.0,v);
+    glVertex2i(x+GLYPHW,y);
+    glTexCoord2d(u+1/16.0,v+1/8.0);
+    glVertex2i(x+GLYPHW,y+GLYPHH);
+    glTexCoord2d(u,v+1/8.0);
+    glVertex2i(x,y+GLYPHH);
+  }
+}
+
 void icosahedron()
 {
   // construct the initial icosahedron
@@ -493,17 +1937,8 @@ void icosahedron()
   vertex[9][0]=+p;  vertex[9][1]=+0;  vertex[9][2]=-1;
   vertex[10][0]=+0; vertex[10][1]=+1; vertex[10][2]=-p;
   vertex[11][0]=+0; vertex[11][1]=-1; vertex[11][2]=-p;
-  // the 20 faces of the icosahedron:
-  int face[20][3]=
-  {
-    {0,1,5},{1,2,5},{2,3,5},{3,4,5},{4,0,5},
-    {0,1,6},{1,2,7},{2,3,8},{3,4,9},{4,0,10},
-    {7,6,1},{8,7,2},{9,8,3},{10,9,4},{6,10,0},
-    {6,7,11},{7,8,11},{8,9,11},{9,10,11},{10,6,11}
-  };
   int i,j,k;
-  struct T *Tp=(struct T *)malloc(20*sizeof(struct T));
-  if (!Tp) die("Cannot malloc space for triangles.");
+  struct T *Tp=levelbuf(0);
   // create face triangles and calculate normals
   for (i=0;i<20;i++)
   {
@@ -527,10 +1962,13 @@ void idle()
   struct timeval tv;
   gettimeofday(&tv,NULL);
   thistime=tv.tv_sec+(tv.tv_usec/1000000.0);
+  if (fastp) thistime=lasttime+TICK; // replaying flat out: simulated clock
 
-  if (thistime-lasttime>.03)
+  if (fastp||thistime-lasttime>TICK)
   {
     // update if enough time has passed
+    if (replayf) replay();   // deliver input events due at this tick
+    if (field.name) fieldtake(); // newest streamed timestep, if any
     if (!animatep)
     {
       facecolor[0]+=facecolor[0]<deffc[0]?0.005:-0.005;
@@ -538,6 +1976,12 @@ void idle()
       facecolor[2]+=facecolor[2]<deffc[2]?0.005:-0.005;
       if (earthalpha<defearthalpha) earthalpha+=0.005;
     }
+    if (tessp&&tessl!=tesstarget)
+    {
+      // shader mode: morph continuously towards the target level
+      if (!animatem||fabs(tesstarget-tessl)<=.02) tessl=tesstarget;
+      else tessl+=tesstarget>tessl?.02:-.02;
+    }
     rotate_la(1);
     if (play)
     {
@@ -548,6 +1992,7 @@ void idle()
     glutPostRedisplay();
     lasttime=thistime;       // record time of last update
     if (animatep) animate(); // update animation settings
+    ++ticks;
   }
 }
 
@@ -567,34 +2012,57 @@ void init()
   glutSpecialFunc(special);
   glutIdleFunc(idle);
   loadtextures();
-  for (i=0;i<levels;i++)
+  for (i=0;i<GRIDS;i++)
   {
     grid[i].Tp=NULL;
     grid[i].nTs=-1;
   }
   earthalpha=defearthalpha;
   icosahedron();
+  if (field.name) fieldopen();
 }
 
 void key(unsigned char ch,int x,int y)
 {
   // handle "normal" keypresses
+  if (replayf&&!injectp&&ch!=27) return; // ignore the keyboard during replay
+  if (recordf) record('k',ch);
   switch(ch)
   {
     case '+': if (dim>=radius+.1) { dim-=.1; --fov; } break;
     case '-': dim+=.1; ++fov; break;
-    case '<': if (level>0) downgrid(); break;
-    case '>': if ((!animatep)&&(level<levels)) upgrid(); return;
+    case '<':
+      if (tessp) { if (tesstarget>0) --tesstarget; }
+      else if (level>0) { downgrid(); if (localp) adapt(); }
+      break;
+    case '>':
+      if (tessp) { if (tesstarget<TESSMAX) ++tesstarget; }
+      else if ((!animatep)&&(level<levels))
+      {
+        upgrid();
+        if (localp) adapt();
+      }
+      return;
     case 'a': axesp=1-axesp; break;
     case 'c': centroidsp=1-centroidsp; break;
     case 'e': edgesp=1-edgesp; break;
     case 'f': fixedp=1-fixedp; break;
     case 'g': play=1-play; break;
+    case 'h':
+      if (!tessprog) tessbuild();
+      if (tessprog) { tessp=1-tessp; tessl=tesstarget=level; }
+      break;
+    case 'H': if (!tessprog) tessbuild(); if (tessprog) tessverify(); break;
+    case 'l': localp=1-localp; if (localp) adapt(); break;
+    case 'i': hudp=1-hudp; framen=0; lastframe=0; break;
     case 'm': if (!animatep) animatem=1-animatem; break;
     case 'n': normalsp=1-normalsp; break;
     case 'r': if (!animatep) refinem=1-refinem; break;
     case 's': spherep=1-spherep; break;
     case 't': ++texturen; texturen%=EARTHS+1; break;
+    case 'v': if (field.name) fieldp=1-fieldp; break;
+    case 'x': export(0); break;
+    case 'X': export(1); break;
     case '0': la=0; ph=0; th=0; break;
     case 27:  exit(0); break;
     // unadvertised control:
@@ -603,6 +2071,115 @@ void key(unsigned char ch,int x,int y)
   project();
 }
 
+struct H *ledge(int a,int b,int create)
+{
+  // find (or create) the entry for edge a-b in the local edge table, which
+  // records its midpoint & how many refined nodes have split it; b>a>=0 in
+  // every entry, so b==0 marks an empty slot
+  int t;
+  size_t h,i;
+  struct H *old;
+  if (a>b)
+  {
+    t=a;
+    a=b;
+    b=t;
+  }
+  if (create&&2*(nledges+1)>maxledges)
+  {
+    // grow & rehash
+    old=ledges;
+    i=maxledges;
+    maxledges=maxledges?2*maxledges:4096;
+    ledges=(struct H *)calloc(maxledges,sizeof(struct H));
+    if (!ledges) die("Cannot malloc space for local edges.");
+    nledges=0;
+    while (i--)
+      if (old[i].b) *ledge(old[i].a,old[i].b,1)=old[i];
+    free(old);
+  }
+  h=((size_t)a*0x9E3779B1u^(size_t)b*0x85EBCA77u)&(maxledges-1);
+  for (;ledges&&ledges[h].b;h=(h+1)&(maxledges-1))
+    if (ledges[h].a==a&&ledges[h].b==b) return &ledges[h];
+  if (!create||!ledges) return NULL;
+  ++nledges;
+  ledges[h].a=a;
+  ledges[h].b=b;
+  return &ledges[h];
+}
+
+struct T *levelbuf(int lvl)
+{
+  // the triangle buffer for a grid level, within an arena reserved on first
+  // use for every level at once: level l starts 20*(4^l-1)/3 triangles in,
+  // & its pages are faulted in by the threads that first refine it, then
+  // reused whenever the level is rebuilt after a downgrid()
+  int l;
+  size_t n;
+  if (!arena)
+  {
+    for (l=0,n=0;l<GRIDS;l++)
+      n+=(size_t)20<<(2*l);
+    arenasize=n*sizeof(struct T);
+    arena=(struct T *)mmap(NULL,arenasize,PROT_READ|PROT_WRITE,
+                           MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+    if (arena==MAP_FAILED) die("Cannot mmap space for triangles.");
+#ifdef MADV_HUGEPAGE
+    madvise(arena,arenasize,MADV_HUGEPAGE); // a hint; failure is harmless
+#endif
+  }
+  return arena+(((size_t)20<<(2*lvl))-20)/3;
+}
+
+int linkprogram(unsigned int prog)
+{
+  // link prog; on failure, print the linker's log & return 0
+  char log[2000];
+  GLint ok=0;
+  glLinkProgram(prog);
+  glGetProgramiv(prog,GL_LINK_STATUS,&ok);
+  if (!ok)
+  {
+    glGetProgramInfoLog(prog,sizeof(log),NULL,log);
+    printf("Cannot link shaders:\n%s\n",log);
+  }
+  return ok;
+}
+
+int lkids(int lvl)
+{
+  // four new sibling leaves at the given level, reusing a freed block of
+  // them if there is one; returns the index of the first
+  int i,k;
+  if (nfreekids)
+    i=freekids[--nfreekids];
+  else
+  {
+    if (nlnodes+4>maxlnodes)
+    {
+      maxlnodes*=2;
+      lnodes=(struct A *)realloc(lnodes,maxlnodes*sizeof(struct A));
+      if (!lnodes) die("Cannot realloc space for local nodes.");
+    }
+    i=nlnodes;
+    nlnodes+=4;
+  }
+  for (k=0;k<4;k++)
+  {
+    lnodes[i+k].level=lvl;
+    lnodes[i+k].kids=0;
+  }
+  return i;
+}
+
+int lmid(int a,int b)
+{
+  // index of the midpoint of edge a-b, or 0 if the edge has never been
+  // split (vertex 0 is an icosahedron corner, never a midpoint)
+  struct H *Hp=ledge(a,b,0);
+  return Hp?Hp->mid:0;
+}
+
 void loadtextures()
 {
   // based on CSCI 5229 loadtexbmp.c
@@ -645,9 +2222,68 @@ void loadtextures()
   }
 }
 
+int lvertex(double *x)
+{
+  // append a vertex to the local vertex table
+  if (nlverts==maxlverts)
+  {
+    maxlverts=maxlverts?2*maxlverts:1024;
+    lverts=(double (*)[3])realloc(lverts,maxlverts*sizeof(lverts[0]));
+    if (!lverts) die("Cannot realloc space for local vertices.");
+  }
+  memcpy(lverts[nlverts],x,sizeof(lverts[0]));
+  return nlverts++;
+}
+
 int main(int argc,char **argv)
 {
+  int benchlvl=-1,opt;
+  while ((opt=getopt(argc,argv,"a:b:fp:r:s:t:x:"))!=-1)
+  {
+    switch(opt)
+    {
+      case 'a': region(optarg); break;
+      case 'b':
+        benchlvl=atoi(optarg);
+        if (benchlvl<0||benchlvl>levels) die("Benchmark level out of range.");
+        break;
+      case 'f': fastp=1; break;
+      case 'p':
+        if (!(replayf=fopen(optarg,"r"))) die("Cannot open replay file.");
+        break;
+      case 'r':
+        if (!(recordf=fopen(optarg,"w"))) die("Cannot open record file.");
+        break;
+      case 's': field.name=optarg; break;
+      case 't': tracename=optarg; break;
+      case 'x':
+        for (exportfmt=2;exportfmt>=0;exportfmt--)
+          if (!strcmp(optarg,exportfmts[exportfmt])) break;
+        if (exportfmt<0) die("Export format must be ply, obj or vtk.");
+        break;
+      default:
+        die("usage: icos [-t tracefile] [-x ply|obj|vtk] [-s fieldstream] "
+            "[-a lat,lon,radius,level]... [-r recordfile | -p replayfile [-f]] "
+            "[-- glut options]\n       icos -b level");
+    }
+  }
+  // the operator benchmark runs headless, so handle it before glut, which
+  // gets whatever follows the options (e.g. -- -display :1)
+  if (benchlvl>=0) return bench(benchlvl);
+  argv[optind-1]=argv[0];
+  argc-=optind-1;
+  argv+=optind-1;
   glutInit(&argc,argv);
+  if (recordf&&replayf) die("Cannot record and replay at once.");
+  if (!nregions) region("40,-105,15,7"); // default: Colorado
+  if (fastp&&!replayf) die("Fast mode (-f) requires a replay file (-p).");
+  if (replayf)
+  {
+    if (!tracename) tracename="-"; // replays always emit frame timings
+    event.kind=0;
+  }
+  if (tracename) atexit(dumptrace);
+  if (recordf) atexit(endrecord);
   init();
   glutMainLoop();
   return(0);
@@ -662,6 +2298,34 @@ void midpoints(struct T *Tp,double m[3][3])
       m[j][k]=(Tp->v[j][k]+Tp->v[(j+1)%3][k])/2;
 }
 
+void newstencil(struct S *s,int n,int w,double *x)
+{
+  // allocate stencil arrays for n control volumes at positions x (projected
+  // onto the sphere); unused slots point back at their own volume with zero
+  // weights, so sweeps need no special case for pentagons
+  int i,j;
+  size_t nw=(size_t)n*w;
+  s->n=n;
+  s->w=w;
+  s->x=(double *)malloc(3*n*sizeof(double));
+  s->nb=(int *)malloc(nw*sizeof(int));
+  s->lap=(double *)calloc(nw,sizeof(double));
+  for (j=0;j<3;j++)
+  {
+    s->g[j]=(double *)calloc(nw,sizeof(double));
+    s->t[j]=(double *)calloc(nw,sizeof(double));
+    if (!s->g[j]||!s->t[j]) die("Cannot malloc space for stencils.");
+  }
+  if (!s->x||!s->nb||!s->lap) die("Cannot malloc space for stencils.");
+  for (i=0;i<n;i++)
+  {
+    for (j=0;j<3;j++)
+      s->x[3*i+j]=x[3*i+j]*radius/distance(0,0,0,x[3*i],x[3*i+1],x[3*i+2]);
+    for (j=0;j<w;j++)
+      s->nb[j*n+i]=i;
+  }
+}
+
 void normal(struct T *Tp,double m[3][3])
 {
   // find the unit normal vector for a triangle
@@ -691,6 +2355,142 @@ void normal(struct T *Tp,double m[3][3])
     for (i=0;i<3;i++) Tp->n[i]*=-1;
 }
 
+double now()
+{
+  // monotonic time in seconds, for instrumentation
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+void opcurl(struct S *s,double *ux,double *uy,double *uz,double *out)
+{
+  // radial component of the curl of a vector field, from the differences of
+  // its cartesian components
+  int b;
+#pragma omp parallel for schedule(static)
+  for (b=0;b<s->n;b+=BLOCK)
+  {
+    int i,k,*nb,n=s->n,e=b+BLOCK<n?b+BLOCK:n;
+    double *tx,*ty,*tz;
+    for (i=b;i<e;i++)
+      out[i]=0;
+    for (k=0;k<s->w;k++)
+    {
+      nb=&s->nb[k*n];
+      tx=&s->t[0][k*n];
+      ty=&s->t[1][k*n];
+      tz=&s->t[2][k*n];
+#pragma omp simd
+      for (i=b;i<e;i++)
+        out[i]+=tx[i]*(ux[nb[i]]-ux[i])+ty[i]*(uy[nb[i]]-uy[i])+
+                tz[i]*(uz[nb[i]]-uz[i]);
+    }
+  }
+}
+
+void opdivergence(struct S *s,double *ux,double *uy,double *uz,double *out)
+{
+  // divergence of a vector field's part tangent to the sphere: that of its
+  // cartesian components, less 2u.x/r^2 for the sphere's curvature
+  double r2=radius*radius;
+  int b;
+#pragma omp parallel for schedule(static)
+  for (b=0;b<s->n;b+=BLOCK)
+  {
+    int i,k,*nb,n=s->n,e=b+BLOCK<n?b+BLOCK:n;
+    double *gx,*gy,*gz,*x=s->x;
+    for (i=b;i<e;i++)
+      out[i]=-2*(x[3*i]*ux[i]+x[3*i+1]*uy[i]+x[3*i+2]*uz[i])/r2;
+    for (k=0;k<s->w;k++)
+    {
+      nb=&s->nb[k*n];
+      gx=&s->g[0][k*n];
+      gy=&s->g[1][k*n];
+      gz=&s->g[2][k*n];
+#pragma omp simd
+      for (i=b;i<e;i++)
+        out[i]+=gx[i]*(ux[nb[i]]-ux[i])+gy[i]*(uy[nb[i]]-uy[i])+
+                gz[i]*(uz[nb[i]]-uz[i]);
+    }
+  }
+}
+
+void opgradient(struct S *s,double *f,double *ox,double *oy,double *oz)
+{
+  // gradient of a scalar field, tangent to the sphere, from differences with
+  // the volume's own value
+  int b;
+#pragma omp parallel for schedule(static)
+  for (b=0;b<s->n;b+=BLOCK)
+  {
+    int i,k,*nb,n=s->n,e=b+BLOCK<n?b+BLOCK:n;
+    double *gx,*gy,*gz;
+    for (i=b;i<e;i++)
+      ox[i]=oy[i]=oz[i]=0;
+    for (k=0;k<s->w;k++)
+    {
+      nb=&s->nb[k*n];
+      gx=&s->g[0][k*n];
+      gy=&s->g[1][k*n];
+      gz=&s->g[2][k*n];
+#pragma omp simd
+      for (i=b;i<e;i++)
+      {
+        double df=f[nb[i]]-f[i];
+        ox[i]+=gx[i]*df;
+        oy[i]+=gy[i]*df;
+        oz[i]+=gz[i]*df;
+      }
+    }
+  }
+}
+
+void oplaplacian(struct S *s,double *f,double *out)
+{
+  // laplacian of a scalar field, from differences with the volume's own
+  // value
+  int b;
+#pragma omp parallel for schedule(static)
+  for (b=0;b<s->n;b+=BLOCK)
+  {
+    int i,k,*nb,n=s->n,e=b+BLOCK<n?b+BLOCK:n;
+    double *c;
+    for (i=b;i<e;i++)
+      out[i]=0;
+    for (k=0;k<s->w;k++)
+    {
+      nb=&s->nb[k*n];
+      c=&s->lap[k*n];
+#pragma omp simd
+      for (i=b;i<e;i++)
+        out[i]+=c[i]*(f[nb[i]]-f[i]);
+    }
+  }
+}
+
+void prune(int i)
+{
+  // free all descendants of node i, un-splitting its edges
+  int e,k,kids=lnodes[i].kids;
+  if (!kids) return;
+  for (k=0;k<4;k++)
+  {
+    prune(kids+k);
+    lnodes[kids+k].level=-1;
+  }
+  for (e=0;e<3;e++)
+    --ledge(lnodes[i].v[e],lnodes[i].v[(e+1)%3],0)->count;
+  if (nfreekids==maxfreekids)
+  {
+    maxfreekids=maxfreekids?2*maxfreekids:256;
+    freekids=(int *)realloc(freekids,maxfreekids*sizeof(int));
+    if (!freekids) die("Cannot realloc space for local free list.");
+  }
+  freekids[nfreekids++]=kids;
+  lnodes[i].kids=0;
+}
+
 void project()
 {
   // set up the projection
@@ -705,6 +2505,12 @@ void project()
   glutPostRedisplay();
 }
 
+void record(char kind,int code)
+{
+  // append an input event, stamped with the current tick & monotonic time
+  fprintf(recordf,"%ld %c %d %.6f\n",ticks,kind,code,now());
+}
+
 void refine()
 {
   // create next grid level by bisecting and extending this grid's triangles
@@ -718,6 +2524,61 @@ void refine()
   if (animatem) animatep=1;
 }
 
+void refinewanted(int i)
+{
+  // refine node i, & its descendants, as far as wantlevel() asks
+  int k;
+  if (!lnodes[i].kids&&lnodes[i].level<wantlevel(i)) splitnode(i);
+  if (lnodes[i].kids)
+    for (k=0;k<4;k++)
+      refinewanted(lnodes[i].kids+k);
+}
+
+void region(char *spec)
+{
+  // add a region of interest, given as "lat,lon,radius,level" in degrees,
+  // taking y as the polar axis & longitude 0 on +z
+  double lat,lon,r,m=PI/180;
+  int l;
+  if (nregions==REGIONS) die("Too many regions.");
+  if (sscanf(spec,"%lf,%lf,%lf,%d",&lat,&lon,&r,&l)!=4)
+    die("Region must be lat,lon,radius,level.");
+  if (l<0||l>LOCALMAX) die("Region level out of range.");
+  regions[nregions].c[0]=cos(lat*m)*sin(lon*m);
+  regions[nregions].c[1]=sin(lat*m);
+  regions[nregions].c[2]=cos(lat*m)*cos(lon*m);
+  regions[nregions].r=r*m;
+  regions[nregions].level=l;
+  ++nregions;
+}
+
+void replay()
+{
+  // deliver every recorded event due at the current tick, through the same
+  // callbacks the keyboard drives; exit when the recorded session ended
+  char kind;
+  while (1)
+  {
+    if (!event.kind)
+    {
+      if (fscanf(replayf,"%ld %c %d %*f",&event.tick,&kind,&event.code)!=3)
+        exit(0);
+      event.kind=kind;
+    }
+    if (event.tick>ticks) return;
+    injectp=1;
+    switch(event.kind)
+    {
+      case 'k': key(event.code,0,0); break;
+      case 's': special(event.code,0,0); break;
+      case 'e': exit(0);
+      default:  die("Bad event in replay file.");
+    }
+    injectp=0;
+    event.kind=0;
+  }
+}
+
 void reshape(int w,int h)
 {
   // handle window resizing
@@ -727,6 +2588,34 @@ void reshape(int w,int h)
   errorcheck();
 }
 
+long resident(int lvl)
+{
+  // bytes of a grid level's part of the arena that are resident in memory,
+  // from mincore() over the pages it spans
+  char *lo,*hi,*p0,*a,*b;
+  long bytes=0,page=sysconf(_SC_PAGESIZE);
+  size_t i,n;
+  unsigned char *vec;
+  if (!arena) return 0;
+  lo=(char *)levelbuf(lvl);
+  hi=lo+((size_t)20<<(2*lvl))*sizeof(struct T);
+  p0=lo-(uintptr_t)lo%page;
+  n=(hi-p0+page-1)/page;
+  vec=(unsigned char *)malloc(n);
+  if (!vec) die("Cannot malloc space for residency vector.");
+  if (mincore(p0,hi-p0,vec)) die("Cannot query resident pages.");
+  for (i=0;i<n;i++)
+    if (vec[i]&1)
+    {
+      // count only the part of a boundary page that is this level's
+      a=p0+i*page;
+      b=a+page;
+      bytes+=(b<hi?b:hi)-(a>lo?a:lo);
+    }
+  free(vec);
+  return bytes;
+}
+
 void rotate_la(double inc)
 {
   // increment/decrement/modulate la
@@ -751,13 +2640,16 @@ void rotate_th(double inc)
 void set_ns_and_cs()
 {
   // set normals & centroids
-  double m[3][3];
   int i;
+  tic(ST_NSCS);
+#pragma omp parallel for schedule(static)
   for (i=0;i<grid[level].nTs;i++)
   {
+    double m[3][3];
     midpoints(&grid[level].Tp[i],m);
     normal(&grid[level].Tp[i],m);
   }
+  toc(ST_NSCS);
 }
 
 void setfc(double *c)
@@ -769,9 +2661,17 @@ void setfc(double *c)
   facecolor[3]=c[3];
 }
 
+struct G *shown()
+{
+  // the grid on display: the local refinement, or the current level
+  return localp?&local:&grid[level];
+}
+
 void special(int key,int x,int y)
 {
   // handle "special" keypresses
+  if (replayf&&!injectp) return; // ignore the keyboard during replay
+  if (recordf) record('s',key);
   switch(key)
   {
     case GLUT_KEY_RIGHT: rotate_th(+2); break;
@@ -786,6 +2686,7 @@ void shellsphere()
 {
   // draw a translucent shell around the geodesic
   int a,b;
+  tic(ST_SPHERE);
   if (texturen!=0)
   {
     // set the texture on the sphere
@@ -813,6 +2714,9 @@ void shellsphere()
   glPopMatrix();
   glDisable(GL_BLEND);
   glDisable(GL_TEXTURE_2D);
+  ntris+=36*73*2;
+  nverts+=36*74*2;
+  toc(ST_SPHERE);
 }
 
 void spherev(double a,double b)
@@ -828,6 +2732,348 @@ void spherev(double a,double b)
   glVertex3d(x,y,z);
 }
 
+int splitp(int a,int b)
+{
+  // is edge a-b currently split by some refined node?
+  struct H *Hp=ledge(a,b,0);
+  return Hp&&Hp->count>0;
+}
+
+void splitnode(int i)
+{
+  // refine node i into four children, as bisect() & extend() do for whole
+  // levels, sharing edge midpoints with the neighbours
+  double d,x[3];
+  int a,b,e,k,kids,m[3],mid,*v;
+  struct H *Hp;
+  for (e=0;e<3;e++)
+  {
+    a=lnodes[i].v[e];
+    b=lnodes[i].v[(e+1)%3];
+    if (!(mid=lmid(a,b)))
+    {
+      for (k=0;k<3;k++)
+        x[k]=(lverts[a][k]+lverts[b][k])/2;
+      d=distance(0,0,0,x[0],x[1],x[2]);
+      for (k=0;k<3;k++)
+        x[k]*=radius/d;
+      mid=lvertex(x);
+    }
+    Hp=ledge(a,b,1);
+    Hp->mid=mid;
+    ++Hp->count;
+    m[e]=mid;
+  }
+  kids=lkids(lnodes[i].level+1);
+  lnodes[i].kids=kids;
+  v=lnodes[i].v;
+  lnodes[kids].v[0]=v[0];   lnodes[kids].v[1]=m[0];   lnodes[kids].v[2]=m[2];
+  lnodes[kids+1].v[0]=m[0]; lnodes[kids+1].v[1]=v[1]; lnodes[kids+1].v[2]=m[1];
+  lnodes[kids+2].v[0]=m[2]; lnodes[kids+2].v[1]=m[1]; lnodes[kids+2].v[2]=v[2];
+  lnodes[kids+3].v[0]=m[0]; lnodes[kids+3].v[1]=m[1]; lnodes[kids+3].v[2]=m[2];
+}
+
+void stencilfit(struct S *s,int i,int *nb,int m)
+{
+  // set control volume i's weights from its m neighbours: fit a quadratic in
+  // tangent-plane coordinates to their differences from the volume's own
+  // value, by least squares weighted by 1/distance^2, & differentiate the
+  // fit at the volume; since the fit is exact for quadratics, the first
+  // derivatives converge at third order & the laplacian at second
+  double a[5][5],b[5][FIT],e[2][3],p[5],h,r=radius,u,v,w,*x=&s->x[3*i],*y;
+  int j,k,l,q;
+  size_t o;
+  // orthonormal tangent basis, starting from an axis away from the normal
+  l=fabs(x[0])>.9*r;
+  for (w=0,j=0;j<3;j++)
+  {
+    e[0][j]=(j==l)-x[l]*x[j]/(r*r);
+    w+=e[0][j]*e[0][j];
+  }
+  for (j=0;j<3;j++)
+    e[0][j]/=sqrt(w);
+  e[1][0]=(x[1]*e[0][2]-x[2]*e[0][1])/r;
+  e[1][1]=(x[2]*e[0][0]-x[0]*e[0][2])/r;
+  e[1][2]=(x[0]*e[0][1]-x[1]*e[0][0])/r;
+  // normal equations, with coordinates scaled by the first neighbour's
+  // distance to keep them well conditioned
+  y=&s->x[3*nb[0]];
+  h=distance(x[0],x[1],x[2],y[0],y[1],y[2]);
+  memset(a,0,sizeof(a));
+  for (q=0;q<m;q++)
+  {
+    y=&s->x[3*nb[q]];
+    for (u=v=0,j=0;j<3;j++)
+    {
+      u+=(y[j]-x[j])*e[0][j]/h;
+      v+=(y[j]-x[j])*e[1][j]/h;
+    }
+    p[0]=u;
+    p[1]=v;
+    p[2]=u*u;
+    p[3]=u*v;
+    p[4]=v*v;
+    w=1/(u*u+v*v);
+    for (j=0;j<5;j++)
+    {
+      for (k=0;k<5;k++)
+        a[j][k]+=w*p[j]*p[k];
+      b[j][q]=w*p[j];
+    }
+  }
+  // solve for the fit's coefficients per neighbour value (the matrix is
+  // symmetric positive definite, so no pivoting)
+  for (j=0;j<5;j++)
+  {
+    if (a[j][j]<1e-12) die("Cannot fit stencil: neighbours are degenerate.");
+    for (k=0;k<5;k++)
+      if (k!=j)
+      {
+        w=a[k][j]/a[j][j];
+        for (l=0;l<5;l++)
+          a[k][l]-=w*a[j][l];
+        for (q=0;q<m;q++)
+          b[k][q]-=w*b[j][q];
+      }
+  }
+  for (j=0;j<5;j++)
+    for (q=0;q<m;q++)
+      b[j][q]/=a[j][j]*(j<2?h:h*h);
+  for (q=0;q<m;q++)
+  {
+    o=(size_t)q*s->n+i;
+    s->nb[o]=nb[q];
+    s->lap[o]=2*(b[2][q]+b[4][q]);
+    for (j=0;j<3;j++)
+    {
+      s->g[j][o]=b[0][q]*e[0][j]+b[1][q]*e[1][j];
+      s->t[j][o]=b[0][q]*e[1][j]-b[1][q]*e[0][j];
+    }
+  }
+}
+
+void tessbuild()
+{
+  // compile & link the shader-mode refinement program; on failure, report
+  // why & leave shader mode unavailable rather than exiting
+  char *src[3][3]=
+  {
+    {tessglsl[0],tessglsl[1],tessglsl[2]},
+    {tessglsl[0],tessglsl[1],tessglsl[3]},
+    {tessglsl[0],tessglsl[4],""},
+  };
+  GLenum kinds[3]={GL_VERTEX_SHADER,GL_GEOMETRY_SHADER,GL_FRAGMENT_SHADER};
+  char *ver=(char *)glGetString(GL_VERSION);
+  const char *capture[1]={"pos"};
+  float base[12][3];
+  int i,j,major=0;
+  if (ver) sscanf(ver,"%d",&major);
+  if (major<4)
+  {
+    printf("Cannot use shader mode without OpenGL 4.0.\n");
+    return;
+  }
+  tessprog=glCreateProgram();
+  for (i=0;i<3;i++)
+    if (!attachshader(tessprog,kinds[i],3,src[i])) break;
+  if (i==3)
+    glTransformFeedbackVaryings(tessprog,1,capture,GL_INTERLEAVED_ATTRIBS);
+  if (i<3||!linkprogram(tessprog))
+  {
+    printf("Cannot build shader mode program.\n");
+    glDeleteProgram(tessprog);
+    tessprog=0;
+    while (glGetError()!=GL_NO_ERROR) ; // don't leave errorcheck() to exit
+    return;
+  }
+  glGenVertexArrays(1,&tessvao);
+  glUseProgram(tessprog);
+  for (i=0;i<12;i++)
+    for (j=0;j<3;j++)
+      base[i][j]=vertex[i][j];
+  glUniform3fv(glGetUniformLocation(tessprog,"base"),12,&base[0][0]);
+  glUniform1iv(glGetUniformLocation(tessprog,"faces"),60,&face[0][0]);
+  glUniform1f(glGetUniformLocation(tessprog,"radius"),radius);
+  glUseProgram(0);
+  errorcheck();
+}
+
+long tesscell(double *x,int dx,int dy,int dz)
+{
+  // key of the verification cell holding x, offset by (dx,dy,dz) cells:
+  // cells are 1e-4*radius across, so coordinates pack exactly into 15 bits
+  double q=1e-4*radius;
+  long i=floor(x[0]/q)+dx+16384,j=floor(x[1]/q)+dy+16384,k=floor(x[2]/q)+dz+16384;
+  return (i<<30)|(j<<15)|k;
+}
+
+void tessdraw(double facec[4],double edgec[4])
+{
+  // draw the grid at fractional level tessl entirely on the gpu, from the
+  // 20 faces of the icosahedron
+  int l=ceil(tessl-1e-9);
+  int sub=l>TESSPATCH?l-TESSPATCH:0; // levels done by instancing patches
+  double m=PI/180;
+  glUseProgram(tessprog);
+  glBindVertexArray(tessvao);
+  glUniform1i(glGetUniformLocation(tessprog,"sublevels"),sub);
+  glUniform1i(glGetUniformLocation(tessprog,"patchlevels"),l-sub);
+  glUniform1f(glGetUniformLocation(tessprog,"morph"),l?tessl-(l-1):1);
+  glUniform3f(glGetUniformLocation(tessprog,"light"),6*cos(la*m),0,6*sin(la*m));
+  glUniform4f(glGetUniformLocation(tessprog,"color"),facec[0],facec[1],facec[2],1);
+  glUniform4f(glGetUniformLocation(tessprog,"edgecolor"),edgec[0],edgec[1],edgec[2],1);
+  glUniform1i(glGetUniformLocation(tessprog,"edges"),edgesp);
+  glDrawArraysInstanced(GL_TRIANGLES,0,60,1<<(2*sub));
+  glBindVertexArray(0);
+  glUseProgram(0);
+  ntris+=(long)20<<(2*l);
+  nverts+=(long)60<<(2*l);
+}
+
+void tessverify()
+{
+  // capture the gpu mesh for the current (extended) grid level with
+  // transform feedback, snap each of its vertices to the cpu mesh & check
+  // that both have the same triangles
+  double d,e,*g,maxd=0,x[3];
+  float *f;
+  int bad,best,got,hi,i,j,k,lo,n=20<<(2*level),*ta,*tb,t[3];
+  int sub=level>TESSPATCH?level-TESSPATCH:0;
+  long *keys,key;
+  struct M m;
+  GLuint buf,query,written;
+  if (animates||animatep)
+  {
+    printf("Finish refining before verifying the shader mesh.\n");
+    return;
+  }
+  // capture
+  glGenBuffers(1,&buf);
+  glBindBuffer(GL_TRANSFORM_FEEDBACK_BUFFER,buf);
+  glBufferData(GL_TRANSFORM_FEEDBACK_BUFFER,(size_t)n*9*sizeof(float),NULL,
+               GL_STREAM_READ);
+  glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER,0,buf);
+  glUseProgram(tessprog);
+  glBindVertexArray(tessvao);
+  glUniform1i(glGetUniformLocation(tessprog,"sublevels"),sub);
+  glUniform1i(glGetUniformLocation(tessprog,"patchlevels"),level-sub);
+  glUniform1f(glGetUniformLocation(tessprog,"morph"),1);
+  glGenQueries(1,&query);
+  glEnable(GL_RASTERIZER_DISCARD);
+  glBeginQuery(GL_PRIMITIVES_GENERATED,query);
+  glBeginTransformFeedback(GL_TRIANGLES);
+  glDrawArraysInstanced(GL_TRIANGLES,0,60,1<<(2*sub));
+  glEndTransformFeedback();
+  glEndQuery(GL_PRIMITIVES_GENERATED);
+  glDisable(GL_RASTERIZER_DISCARD);
+  glGetQueryObjectuiv(query,GL_QUERY_RESULT,&written);
+  glDeleteQueries(1,&query);
+  got=written<(GLuint)n?written:n; // any excess wasn't captured
+  glBindVertexArray(0);
+  glUseProgram(0);
+  f=(float *)glMapBuffer(GL_TRANSFORM_FEEDBACK_BUFFER,GL_READ_ONLY);
+  if (!f) die("Cannot map transform feedback buffer.");
+  // index the cpu vertices by cell, at a resolution well above float error
+  buildmesh(grid[level].Tp,gridsize(level),&m);
+  keys=(long *)malloc(2*m.nv*sizeof(long));
+  if (!keys) die("Cannot malloc space for shader verification.");
+  for (i=0;i<m.nv;i++)
+  {
+    keys[2*i]=tesscell(&m.v[3*i],0,0,0);
+    keys[2*i+1]=i;
+  }
+  qsort(keys,m.nv,2*sizeof(long),cmpl);
+  ta=(int *)malloc(3*(size_t)n*sizeof(int));
+  tb=(int *)malloc(3*(size_t)m.np*sizeof(int));
+  if (!ta||!tb) die("Cannot malloc space for shader verification.");
+  for (i=0;i<3*got;i++)
+  {
+    // nearest cpu vertex, searching this & adjacent cells
+    for (j=0;j<3;j++)
+      x[j]=f[3*i+j];
+    for (e=radius,best=-1,j=0;j<27;j++)
+    {
+      key=tesscell(x,j%3-1,j/3%3-1,j/9-1);
+      for (lo=0,hi=m.nv;lo<hi;)
+        if (keys[2*((lo+hi)/2)]<key) lo=(lo+hi)/2+1; else hi=(lo+hi)/2;
+      for (k=lo;k<m.nv&&keys[2*k]==key;k++)
+      {
+        g=&m.v[3*keys[2*k+1]];
+        d=distance(x[0],x[1],x[2],g[0],g[1],g[2]);
+        if (d<e)
+        {
+          e=d;
+          best=keys[2*k+1];
+        }
+      }
+    }
+    if (e>maxd) maxd=e;
+    ta[i]=e<1e-5*radius?best:-1; // too far to be the same vertex
+  }
+  glUnmapBuffer(GL_TRANSFORM_FEEDBACK_BUFFER);
+  glDeleteBuffers(1,&buf);
+  // sort each triangle's vertices, then the triangles, & count the gpu
+  // triangles that aren't in the cpu mesh
+  for (i=0;i<m.np;i++)
+    memcpy(&tb[3*i],&m.p[m.o[i]],3*sizeof(int));
+  for (i=0;i<got+m.np;i++)
+  {
+    k=i<got?3*i:3*(i-got);
+    memcpy(t,i<got?&ta[k]:&tb[k],sizeof(t));
+    if (t[0]>t[1]) j=t[0],t[0]=t[1],t[1]=j;
+    if (t[1]>t[2]) j=t[1],t[1]=t[2],t[2]=j;
+    if (t[0]>t[1]) j=t[0],t[0]=t[1],t[1]=j;
+    memcpy(i<got?&ta[k]:&tb[k],t,sizeof(t));
+  }
+  qsort(ta,got,3*sizeof(int),cmpt);
+  qsort(tb,m.np,3*sizeof(int),cmpt);
+  for (bad=i=j=0;i<got;i++)
+  {
+    while (j<m.np&&cmpt(&tb[3*j],&ta[3*i])<0) j++;
+    if (j<m.np&&!cmpt(&tb[3*j],&ta[3*i])) j++; else bad++;
+  }
+  printf("Shader mesh at level %d: %u of %d triangles, %d not in the cpu "
+         "mesh, max distance to cpu vertices %.3g (%s).\n",level,written,
+         m.np,bad,maxd,written==(GLuint)m.np&&!bad?"match":"MISMATCH");
+  free(ta);
+  free(tb);
+  free(keys);
+  freemesh(&m);
+  errorcheck();
+}
+
+
+void tic(int s)
+{
+  // start timing a stage (if instrumenting), on the gpu too if it draws
+  if (!timingp()) return;
+  stagestart[s]=now();
+  if (s<ST_BISECT)
+  {
+    if (!stagequeries[0][0]) glGenQueries(2*ST_BISECT,stagequeries[0]);
+    glBeginQuery(GL_TIME_ELAPSED,stagequeries[stageq][s]);
+  }
+}
+
+int timingp()
+{
+  // instrument only when someone is looking
+  return hudp||tracename;
+}
+
+void toc(int s)
+{
+  // stop timing a stage & charge its cost to this frame (if instrumenting);
+  // gpu times are collected by endframe() a frame later, once they're done
+  if (!timingp()) return;
+  stagecur[s]+=(now()-stagestart[s])*1000;
+  if (s<ST_BISECT)
+  {
+    glEndQuery(GL_TIME_ELAPSED);
+    stageran[stageq][s]=1;
+  }
+}
+
 void upgrid()
 {
   // increase the grid level
@@ -840,3 +3086,102 @@ void upgrid()
   if (!animates) ++level;
   refine();
 }
+
+int wantlevel(int i)
+{
+  // the level node i should be refined to: the base (current) level, or
+  // that of the finest region whose cap overlaps it, i.e. whose centre is
+  // within the cap radius plus the node's angular circumradius of its
+  // centroid, so that regions smaller than the node are still reached
+  double a,c[3],d,e=0,*x;
+  int j,k,l=level,*v=lnodes[i].v;
+  for (k=0;k<3;k++)
+    c[k]=lverts[v[0]][k]+lverts[v[1]][k]+lverts[v[2]][k];
+  d=distance(0,0,0,c[0],c[1],c[2]);
+  for (k=0;k<3;k++)
+  {
+    x=lverts[v[k]];
+    a=(c[0]*x[0]+c[1]*x[1]+c[2]*x[2])/(d*distance(0,0,0,x[0],x[1],x[2]));
+    a=acos(a>1?1:a);
+    if (a>e) e=a;
+  }
+  for (j=0;j<nregions;j++)
+  {
+    if (regions[j].level<=l) continue;
+    a=(c[0]*regions[j].c[0]+c[1]*regions[j].c[1]+c[2]*regions[j].c[2])/d;
+    if (acos(a>1?1:a<-1?-1:a)<=regions[j].r+e) l=regions[j].level;
+  }
+  return l;
+}
+
+void wbe32(struct W *w,uint32_t x)
+{
+  // append a 32-bit integer, big-endian
+  unsigned char b[4]={x>>24,x>>16,x>>8,x};
+  wbytes(w,b,4);
+}
+
+void wbe64(struct W *w,double d)
+{
+  // append a double, big-endian
+  int i;
+  uint64_t x;
+  unsigned char b[8];
+  memcpy(&x,&d,8);
+  for (i=0;i<8;i++)
+    b[i]=x>>(56-8*i);
+  wbytes(w,b,8);
+}
+
+void wbytes(struct W *w,void *p,size_t n)
+{
+  // append bytes to the chunk, writing the chunk out whenever it fills
+  if (w->n+n>WBUF)
+  {
+    wflush(w);
+    if (n>WBUF)
+    {
+      if (fwrite(p,1,n,w->f)!=n) die("Cannot write export file.");
+      return;
+    }
+  }
+  memcpy(w->buf+w->n,p,n);
+  w->n+=n;
+}
+
+void wclose(struct W *w)
+{
+  // write out the last chunk & release the writer
+  wflush(w);
+  if (fclose(w->f)) die("Cannot close export file.");
+  free(w->buf);
+}
+
+void wflush(struct W *w)
+{
+  // write out the chunk filled so far
+  if (w->n&&fwrite(w->buf,1,w->n,w->f)!=w->n) die("Cannot write export file.");
+  w->n=0;
+}
+
+void wopen(struct W *w,char *name)
+{
+  // open a writer on a file; the chunk replaces stdio's own buffering
+  if (!(w->f=fopen(name,"wb"))) die("Cannot open export file.");
+  setvbuf(w->f,NULL,_IONBF,0);
+  if (!(w->buf=(char *)malloc(WBUF))) die("Cannot malloc space for export buffer.");
+  w->n=0;
+}
+
+void wprintf(struct W *w,char *fmt,...)
+{
+  // append formatted text to the chunk (at most a short line per call)
+  int n;
+  va_list ap;
+  if (WBUF-w->n<1024) wflush(w);
+  va_start(ap,fmt);
+  n=vsnprintf(w->buf+w->n,WBUF-w->n,fmt,ap);
+  va_end(ap);
+  if (n<0||n>=1024) die("Export text too long.");
+  w->n+=n;
+}